@@ -0,0 +1,176 @@
+/*
+   Generation arena allocator
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "arena.h"
+#include "nfblockd.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (1024 * 1024)
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+
+/* the header is padded to keep the allocations aligned */
+#define BLOCK_HEADER ALIGN_UP(sizeof(arena_block_t), ARENA_ALIGN)
+
+void
+arena_init(arena_t* arena)
+{
+    arena->head = NULL;
+    arena->reserve = ARENA_MIN_BLOCK;
+    arena->last = NULL;
+    arena->released = 0;
+}
+
+/* Sets the size of the next mapping, typically from an estimate of
+   the total amount of memory needed by the generation. It is only a
+   hint, if it cannot be mapped only the requested size is. */
+void
+arena_reserve(arena_t* arena, size_t size)
+{
+    if (size > arena->reserve)
+        arena->reserve = size;
+}
+
+static arena_block_t*
+arena_map(arena_t* arena, size_t size)
+{
+    arena_block_t* b;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t need = ALIGN_UP(size + BLOCK_HEADER, pagesize);
+
+    size = need;
+    if (size < arena->reserve)
+        size = ALIGN_UP(arena->reserve, pagesize);
+
+    b = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (b == MAP_FAILED && size > need) {
+        /* the reserve is only a hint, fall back to the normal growth */
+        size_t hint = size;
+        size = need < ARENA_MIN_BLOCK ? ARENA_MIN_BLOCK : need;
+        do_log(LOG_INFO, "Cannot map %zu bytes: %s, mapping %zu", hint,
+            strerror(errno), size);
+        arena->reserve = ARENA_MIN_BLOCK;
+        b = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (b == MAP_FAILED) {
+        do_log(LOG_ERR, "Cannot map %zu bytes: %s", size, strerror(errno));
+        return NULL;
+    }
+    b->next = arena->head;
+    b->size = size;
+    b->used = BLOCK_HEADER;
+    arena->head = b;
+    return b;
+}
+
+void*
+arena_alloc(arena_t* arena, size_t size)
+{
+    arena_block_t* b = arena->head;
+    void* ptr;
+
+    size = ALIGN_UP(size, ARENA_ALIGN);
+    if (!b || b->size - b->used < size) {
+        b = arena_map(arena, size);
+        CHECK_OOM(b);
+    }
+    ptr = (char*)b + b->used;
+    b->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+/* Resizes an allocation. The most recent one is extended in place if
+   possible, anything else is copied. */
+void*
+arena_realloc(arena_t* arena, void* ptr, size_t old_size, size_t new_size)
+{
+    arena_block_t* b = arena->head;
+    void* ret;
+
+    if (!ptr)
+        return arena_alloc(arena, new_size);
+
+    old_size = ALIGN_UP(old_size, ARENA_ALIGN);
+    new_size = ALIGN_UP(new_size, ARENA_ALIGN);
+    if (ptr == arena->last && (char*)ptr + old_size == (char*)b + b->used
+        && b->used - old_size + new_size <= b->size) {
+        b->used = b->used - old_size + new_size;
+        return ptr;
+    }
+    if (new_size <= old_size)
+        return ptr;
+
+    ret = arena_alloc(arena, new_size);
+    memcpy(ret, ptr, old_size);
+    arena_release(arena, ptr, old_size);
+    return ret;
+}
+
+/* Returns the whole pages inside the given range back to the
+   system. The range stays mapped and reads back as zeros. */
+void
+arena_release(arena_t* arena, void* ptr, size_t size)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ALIGN_UP((uintptr_t)ptr, pagesize);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~((uintptr_t)pagesize - 1);
+
+    if (end > start) {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+        arena->released += end - start;
+    }
+}
+
+void
+arena_free(arena_t* arena)
+{
+    arena_block_t* b = arena->head;
+
+    while (b) {
+        arena_block_t* next = b->next;
+        munmap(b, b->size);
+        b = next;
+    }
+    arena_init(arena);
+}
+
+/* Bytes handed out and not released. The mappings themselves are
+   mostly untouched address space. */
+size_t
+arena_used(const arena_t* arena)
+{
+    const arena_block_t* b;
+    size_t total = 0;
+
+    for (b = arena->head; b; b = b->next)
+        total += b->used;
+    return total - arena->released;
+}
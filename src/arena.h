@@ -0,0 +1,58 @@
+/*
+   Generation arena allocator
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* All memory of one blocklist generation is carved out of a few large
+   anonymous mappings, so that dropping the generation returns
+   everything to the system at once instead of fragmenting the heap.
+   The mappings are reserved with MAP_NORESERVE, pages which are never
+   touched do not count towards the resident size. */
+
+typedef struct arena_block_t {
+    struct arena_block_t* next;
+    size_t size, used;
+} arena_block_t;
+
+typedef struct arena_t {
+    arena_block_t* head;
+    /* size of the next block to be mapped */
+    size_t reserve;
+    /* the most recent allocation, can be resized in place */
+    void* last;
+    /* bytes given back by arena_release */
+    size_t released;
+} arena_t;
+
+void arena_init(arena_t* arena);
+void arena_reserve(arena_t* arena, size_t size);
+void* arena_alloc(arena_t* arena, size_t size);
+void* arena_realloc(arena_t* arena, void* ptr, size_t old_size, size_t new_size);
+void arena_release(arena_t* arena, void* ptr, size_t size);
+void arena_free(arena_t* arena);
+size_t arena_used(const arena_t* arena);
+
+#endif
@@ -23,9 +23,12 @@
 
 #include "blocklist.h"
 #include "nfblockd.h"
+#include "probes.h"
+#include "rangeset.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +37,7 @@
 void
 blocklist_init(blocklist_t* blocklist)
 {
+    arena_init(&blocklist->arena);
     blocklist->entries = NULL;
     blocklist->entries2 = NULL;
     blocklist->count = 0;
@@ -41,109 +45,97 @@ blocklist_init(blocklist_t* blocklist)
 #ifndef LOWMEM
     blocklist->subentries = 0;
     blocklist->subcount = 0;
+    blocklist->submax = 0;
+    arena_init(&blocklist->label_arena);
+    label_pool_init(&blocklist->labels, &blocklist->label_arena);
 #endif
+    blocklist->list = 0;
+}
+
+/* The two entry arrays share one allocation while the lists are
+   loaded, entries2 right behind entries, so that growing them only
+   extends the most recent allocation of the arena. Sorting gives
+   each array its own allocation, nothing is appended after that. */
+static void
+blocklist_resize(blocklist_t* blocklist, unsigned int size)
+{
+    size_t per_entry = sizeof(block_entry_t) + sizeof(block_entry2_t);
+    char* region;
+
+    assert(!blocklist->entries
+        || (char*)blocklist->entries2 == (char*)(blocklist->entries + blocklist->size));
+    /* a new mapping leaves room for two more doublings in place */
+    arena_reserve(&blocklist->arena, per_entry * size * 4);
+    region = arena_realloc(&blocklist->arena, blocklist->entries,
+        per_entry * blocklist->size, per_entry * size);
+    blocklist->entries = (block_entry_t*)region;
+    blocklist->entries2 = (block_entry2_t*)(region + sizeof(block_entry_t) * size);
+    /* entries2 moves up behind the grown entries */
+    memmove(blocklist->entries2, region + sizeof(block_entry_t) * blocklist->size,
+        sizeof(block_entry2_t) * blocklist->count);
+    blocklist->size = size;
+}
+
+/* Sizes the next arena mapping for the given number of additional
+   entries, so the lists can be loaded without remapping. The count
+   is only an estimate, the arrays still grow as the entries come. */
+void
+blocklist_reserve(blocklist_t* blocklist, unsigned int count)
+{
+    size_t per_entry = sizeof(block_entry_t) + sizeof(block_entry2_t);
+
+#ifndef LOWMEM
+    per_entry += sizeof(block_sub_entry_t);
+    /* a rough guess of the label pool */
+    arena_reserve(&blocklist->label_arena, (size_t)count * 8);
+#endif
+    arena_reserve(&blocklist->arena, (size_t)count * per_entry);
 }
 
 void
 blocklist_append(blocklist_t* blocklist,
     uint32_t ip_min, uint32_t ip_max,
-    const char* name, iconv_t ic)
+    const char* name)
 {
     block_entry_t* e;
     block_entry2_t* e2;
 
-    if (blocklist->size == blocklist->count) {
-        blocklist->size += 16384;
-        blocklist->entries = realloc(blocklist->entries, sizeof(block_entry_t) * blocklist->size);
-        blocklist->entries2 = realloc(blocklist->entries2, sizeof(block_entry2_t) * blocklist->size);
-        CHECK_OOM(blocklist->entries);
-        CHECK_OOM(blocklist->entries2);
-    }
+    if (blocklist->size == blocklist->count)
+        blocklist_resize(blocklist, blocklist->size ? blocklist->size * 2 : 16384);
     e = blocklist->entries + blocklist->count;
     e2 = blocklist->entries2 + blocklist->count;
     e->ip_min = ip_min;
     e->ip_max = ip_max;
 #ifndef LOWMEM
-    if (ic != (iconv_t)-1) {
-        char buf2[MAX_LABEL_LENGTH];
-        size_t insize, outsize;
-        char *inb, *outb;
-        int ret;
-
-        insize = strlen(name);
-        inb = (char*)name;
-        outsize = MAX_LABEL_LENGTH - 1;
-        outb = buf2;
-        memset(buf2, 0, MAX_LABEL_LENGTH);
-        ret = iconv(ic, &inb, &insize, &outb, &outsize);
-        if (ret >= 0) {
-            e2->name = strdup(buf2);
-        } else {
-            do_log(LOG_ERR, "Cannot convert string: %s", strerror(errno));
-            e2->name = strdup("(conversion error)");
-        }
-    } else {
-        e2->name = strdup(name);
-    }
+    e2->label = label_intern(&blocklist->labels, name);
     e2->merged_idx = -1;
+    e2->merged_count = 0;
 #endif
-    e2->hits = 0;
-    e2->lasttime = 0;
+    e2->lists = 1u << blocklist->list;
     blocklist->count++;
 }
 
 void
 blocklist_clear(blocklist_t* blocklist, int start)
 {
-    unsigned int i;
-
-    for (i = start; i < blocklist->count; i++) {
-#ifndef LOWMEM
-        if (blocklist->entries2[i].name) {
-            free(blocklist->entries2[i].name);
-            blocklist->entries2[i].name = NULL;
-        }
-#endif
-    }
-
     if (start == 0) {
-        free(blocklist->entries);
-        free(blocklist->entries2);
-        blocklist->entries = NULL;
-        blocklist->entries2 = NULL;
-        blocklist->count = 0;
-        blocklist->size = 0;
+        arena_free(&blocklist->arena);
 #ifndef LOWMEM
-        if (blocklist->subentries) {
-            for (i = 0; i < blocklist->subcount; i++)
-                if (blocklist->subentries[i].name)
-                    free(blocklist->subentries[i].name);
-            free(blocklist->subentries);
-            blocklist->subentries = NULL;
-        }
-        blocklist->subcount = 0;
+        arena_free(&blocklist->label_arena);
 #endif
+        blocklist_init(blocklist);
     } else {
-        blocklist->size = blocklist->count = start;
-        blocklist->entries = realloc(blocklist->entries,
-            sizeof(block_entry_t) * blocklist->size);
-        blocklist->entries2 = realloc(blocklist->entries2,
-            sizeof(block_entry2_t) * blocklist->size);
-        CHECK_OOM(blocklist->entries);
-        CHECK_OOM(blocklist->entries2);
+        blocklist_truncate(blocklist, start);
     }
 }
 
-static int
-block_entry_compare(const void* a, const void* b)
+/* Drops the entries past count, keeping the memory for reuse. Labels
+   of the dropped entries stay in the pool until the list is cleared. */
+void
+blocklist_truncate(blocklist_t* blocklist, unsigned int count)
 {
-    const block_entry_t* e1 = a;
-    const block_entry_t* e2 = b;
-    if (e1->ip_min < e2->ip_min)
-        return -1;
-    if (e1->ip_min > e2->ip_min)
-        return 1;
-    return 0;
+    if (count < blocklist->count)
+        blocklist->count = count;
 }
 
 static int
@@ -156,199 +148,645 @@ block_key_compare(const block_entry_t* key, const block_entry_t* entry)
     return 0;
 }
 
+/* LSD radix sort of the range starts. The (key, index) pairs are
+   sorted first, the entries are permuted afterwards. */
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+
+/* smallest number of entries per thread worth starting a thread for */
+#define RADIX_MIN_CHUNK 65536
+
+typedef struct sort_item_t {
+    uint32_t key, idx;
+} sort_item_t;
+
+typedef struct radix_sort_t {
+    sort_item_t* buf[2];
+    unsigned int count, threads;
+    /* per-thread histograms, turned into scatter offsets */
+    unsigned int (*hist)[RADIX_SIZE];
+    /* set when the current digit is the same for all keys */
+    int skip;
+    /* index of the buffer holding the result */
+    int result;
+    pthread_barrier_t barrier;
+    /* the threads wait for ready, until the number of them is known */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;
+} radix_sort_t;
+
+typedef struct radix_thread_t {
+    radix_sort_t* rs;
+    unsigned int id;
+} radix_thread_t;
+
+static void*
+radix_sort_thread(void* arg)
+{
+    radix_thread_t* t = arg;
+    radix_sort_t* rs = t->rs;
+    unsigned int* hist = rs->hist[t->id];
+    unsigned int start, end;
+    unsigned int pass, i, d, cur = 0;
+
+    pthread_mutex_lock(&rs->lock);
+    while (!rs->ready)
+        pthread_cond_wait(&rs->cond, &rs->lock);
+    pthread_mutex_unlock(&rs->lock);
+    start = (uint64_t)rs->count * t->id / rs->threads;
+    end = (uint64_t)rs->count * (t->id + 1) / rs->threads;
+
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+        unsigned int shift = pass * RADIX_BITS;
+        sort_item_t* src = rs->buf[cur];
+        sort_item_t* dst = rs->buf[cur ^ 1];
+
+        memset(hist, 0, sizeof(unsigned int) * RADIX_SIZE);
+        for (i = start; i < end; i++)
+            hist[(src[i].key >> shift) & (RADIX_SIZE - 1)]++;
+        pthread_barrier_wait(&rs->barrier);
+
+        if (t->id == 0) {
+            unsigned int sum = 0, tid;
+            rs->skip = 0;
+            for (d = 0; d < RADIX_SIZE; d++) {
+                unsigned int total = 0;
+                for (tid = 0; tid < rs->threads; tid++) {
+                    unsigned int n = rs->hist[tid][d];
+                    rs->hist[tid][d] = sum + total;
+                    total += n;
+                }
+                if (total == rs->count)
+                    rs->skip = 1;
+                sum += total;
+            }
+        }
+        pthread_barrier_wait(&rs->barrier);
+
+        if (rs->skip)
+            continue;
+        for (i = start; i < end; i++)
+            dst[hist[(src[i].key >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+        cur ^= 1;
+        pthread_barrier_wait(&rs->barrier);
+    }
+
+    if (t->id == 0)
+        rs->result = cur;
+    return NULL;
+}
+
+/* Sorts the entries by the range start, keeping entries2 paired with
+   them. Large lists are sorted by up to the given number of threads. */
 void
-blocklist_sort(blocklist_t* blocklist)
+blocklist_sort(blocklist_t* blocklist, int threads)
+{
+    radix_sort_t rs;
+    radix_thread_t* t;
+    pthread_t* tids;
+    sort_item_t* items;
+    block_entry_t* entries;
+    block_entry2_t* entries2;
+    unsigned int i, n = blocklist->count;
+    int rv;
+
+    if (n < 2)
+        return;
+
+    if (threads < 1 || n / RADIX_MIN_CHUNK < 2)
+        threads = 1;
+    else if ((unsigned int)threads > n / RADIX_MIN_CHUNK)
+        threads = n / RADIX_MIN_CHUNK;
+    PROBE2(sort_start, n, threads);
+
+    rs.count = n;
+    rs.threads = threads;
+    rs.buf[0] = arena_alloc(&blocklist->arena, sizeof(sort_item_t) * n);
+    rs.buf[1] = arena_alloc(&blocklist->arena, sizeof(sort_item_t) * n);
+    rs.hist = arena_alloc(&blocklist->arena, sizeof(*rs.hist) * threads);
+    t = arena_alloc(&blocklist->arena, sizeof(radix_thread_t) * threads);
+    tids = arena_alloc(&blocklist->arena, sizeof(pthread_t) * threads);
+    pthread_mutex_init(&rs.lock, NULL);
+    pthread_cond_init(&rs.cond, NULL);
+    rs.ready = 0;
+
+    for (i = 0; i < n; i++) {
+        rs.buf[0][i].key = blocklist->entries[i].ip_min;
+        rs.buf[0][i].idx = i;
+    }
+
+    for (i = 0; i < (unsigned int)threads; i++) {
+        t[i].rs = &rs;
+        t[i].id = i;
+    }
+    for (i = 1; i < (unsigned int)threads; i++) {
+        rv = pthread_create(&tids[i], NULL, radix_sort_thread, &t[i]);
+        if (rv != 0) {
+            /* the ones started so far split the work among themselves */
+            do_log(LOG_ERR, "Cannot create sorting thread: %s, sorting with %u",
+                strerror(rv), i);
+            break;
+        }
+    }
+    rs.threads = i;
+    pthread_barrier_init(&rs.barrier, NULL, rs.threads);
+    pthread_mutex_lock(&rs.lock);
+    rs.ready = 1;
+    pthread_cond_broadcast(&rs.cond);
+    pthread_mutex_unlock(&rs.lock);
+
+    radix_sort_thread(&t[0]);
+    for (i = 1; i < rs.threads; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&rs.barrier);
+    pthread_cond_destroy(&rs.cond);
+    pthread_mutex_destroy(&rs.lock);
+    PROBE1(sort_radix_done, n);
+
+    /* Gather the entries in the sorted order. The reads are random but
+       independent, which is a lot faster than permuting in place. */
+    items = rs.buf[rs.result];
+    entries = arena_alloc(&blocklist->arena, sizeof(block_entry_t) * n);
+    entries2 = arena_alloc(&blocklist->arena, sizeof(block_entry2_t) * n);
+    for (i = 0; i < n; i++) {
+        entries[i] = blocklist->entries[items[i].idx];
+        entries2[i] = blocklist->entries2[items[i].idx];
+    }
+    arena_release(&blocklist->arena, blocklist->entries, sizeof(block_entry_t) * blocklist->size);
+    arena_release(&blocklist->arena, blocklist->entries2, sizeof(block_entry2_t) * blocklist->size);
+    blocklist->entries = entries;
+    blocklist->entries2 = entries2;
+    blocklist->size = n;
+
+    arena_release(&blocklist->arena, rs.buf[0], sizeof(sort_item_t) * n);
+    arena_release(&blocklist->arena, rs.buf[1], sizeof(sort_item_t) * n);
+    PROBE1(sort_done, n);
+}
+
+/* Reports the entries [first, last) merged into one range, either to
+   the report file or to the debug log */
+static void
+report_merge(blocklist_t* blocklist, unsigned int first, unsigned int last,
+    uint32_t ip_max, FILE* report)
 {
-    qsort(blocklist->entries, blocklist->count, sizeof(block_entry_t), block_entry_compare);
+    char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
+    char *tmp = NULL, *p = NULL;
+    uint32_t ip1, ip2;
+    unsigned int k;
+
+    if (!report) {
+        tmp = malloc(32 * (last - first) + 1);
+        CHECK_OOM(tmp);
+        p = tmp;
+        *p = 0;
+    }
+    /* List the merged entries */
+    for (k = first; k < last; k++) {
+        ip1 = htonl(blocklist->entries[k].ip_min);
+        ip2 = htonl(blocklist->entries[k].ip_max);
+        inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
+        inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
+        if (report)
+            fprintf(report, "%s-%s ", buf1, buf2);
+        else
+            p += sprintf(p, "%s-%s ", buf1, buf2);
+    }
+    ip1 = htonl(blocklist->entries[first].ip_min);
+    ip2 = htonl(ip_max);
+    inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
+    inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
+    if (report) {
+        fprintf(report, "into %s-%s\n", buf1, buf2);
+    } else {
+        do_log(LOG_DEBUG, "Merging ranges: %sinto %s-%s", tmp, buf1, buf2);
+        free(tmp);
+    }
 }
 
+#ifndef LOWMEM
+typedef struct list_event_t {
+    uint64_t pos;
+    uint32_t lists;
+    int start;
+} list_event_t;
+
+static int
+compare_events(const void* p1, const void* p2)
+{
+    const list_event_t* e1 = p1;
+    const list_event_t* e2 = p2;
+
+    if (e1->pos != e2->pos)
+        return e1->pos < e2->pos ? -1 : 1;
+    return 0;
+}
+
+/* Cuts a composite range into pieces with a constant list mask,
+   storing them from out on if not NULL. Returns the piece count. */
+static unsigned int
+split_composite(blocklist_t* blocklist, unsigned int idx,
+    list_event_t* events, block_entry_t* out, block_entry2_t* out2)
+{
+    block_entry_t* e = &blocklist->entries[idx];
+    block_entry2_t* e2 = &blocklist->entries2[idx];
+    unsigned int cnt[MAX_LISTS] = { 0 };
+    unsigned int i, j, k, n = 0, nevents = 0;
+    uint64_t pos = e->ip_min;
+    uint32_t mask = 0, last = 0;
+
+    for (i = e2->merged_idx; i < e2->merged_idx + e2->merged_count; i++) {
+        block_sub_entry_t* s = &blocklist->subentries[i];
+        events[nevents].pos = s->ip_min;
+        events[nevents].lists = s->lists;
+        events[nevents++].start = 1;
+        events[nevents].pos = (uint64_t)s->ip_max + 1;
+        events[nevents].lists = s->lists;
+        events[nevents++].start = 0;
+    }
+    qsort(events, nevents, sizeof(list_event_t), compare_events);
+
+    for (i = 0; i < nevents; i = j) {
+        if (events[i].pos > pos) {
+            /* [pos, events[i].pos - 1] has the current mask */
+            if (n > 0 && mask == last) {
+                if (out)
+                    out[n - 1].ip_max = events[i].pos - 1;
+            } else {
+                if (out) {
+                    out[n].ip_min = pos;
+                    out[n].ip_max = events[i].pos - 1;
+                    out2[n] = *e2;
+                    out2[n].lists = mask;
+                }
+                last = mask;
+                n++;
+            }
+            pos = events[i].pos;
+        }
+        for (j = i; j < nevents && events[j].pos == events[i].pos; j++) {
+            for (k = 0; k < MAX_LISTS; k++) {
+                if (!(events[j].lists & (1u << k)))
+                    continue;
+                if (events[j].start) {
+                    cnt[k]++;
+                    mask |= 1u << k;
+                } else if (--cnt[k] == 0) {
+                    mask &= ~(1u << k);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+/* Splits the composite ranges built from several lists, so that the
+   list mask is valid for every address of a range */
+static void
+blocklist_split(blocklist_t* blocklist)
+{
+    unsigned int i, n, count = 0, maxsub = 0;
+    block_entry_t* entries;
+    block_entry2_t* entries2;
+    list_event_t* events;
+
+    for (i = 0; i < blocklist->count; i++) {
+        block_entry2_t* e2 = &blocklist->entries2[i];
+        if (e2->label == LABEL_NONE && (e2->lists & (e2->lists - 1))
+            && e2->merged_count > maxsub)
+            maxsub = e2->merged_count;
+    }
+    if (maxsub == 0)
+        return;
+
+    events = malloc(sizeof(list_event_t) * 2 * maxsub);
+    CHECK_OOM(events);
+
+    for (i = 0; i < blocklist->count; i++) {
+        block_entry2_t* e2 = &blocklist->entries2[i];
+        if (e2->label == LABEL_NONE && (e2->lists & (e2->lists - 1)))
+            count += split_composite(blocklist, i, events, NULL, NULL);
+        else
+            count++;
+    }
+
+    /* a single piece means the mask is the same all over the range */
+    if (count > blocklist->count) {
+        entries = arena_alloc(&blocklist->arena, sizeof(block_entry_t) * count);
+        entries2 = arena_alloc(&blocklist->arena, sizeof(block_entry2_t) * count);
+        for (i = 0, n = 0; i < blocklist->count; i++) {
+            block_entry2_t* e2 = &blocklist->entries2[i];
+            if (e2->label == LABEL_NONE && (e2->lists & (e2->lists - 1))) {
+                n += split_composite(blocklist, i, events, entries + n, entries2 + n);
+            } else {
+                entries[n] = blocklist->entries[i];
+                entries2[n++] = *e2;
+            }
+        }
+        do_log(LOG_DEBUG, "%d ranges split by list", count - blocklist->count);
+
+        arena_release(&blocklist->arena, blocklist->entries, sizeof(block_entry_t) * blocklist->size);
+        arena_release(&blocklist->arena, blocklist->entries2, sizeof(block_entry2_t) * blocklist->size);
+        blocklist->entries = entries;
+        blocklist->entries2 = entries2;
+        blocklist->count = blocklist->size = count;
+    }
+    free(events);
+}
+#endif
+
+#ifndef LOWMEM
+/* The sub-entries of a composite are sorted by ip_min. They are seen
+   as a binary tree rooted at the midpoint of [lo, hi), each node
+   holding the highest ip_max of its subtree, so that blocklist_names
+   can skip the subtrees ending below the address. */
+static uint32_t
+submax_node(blocklist_t* blocklist, unsigned int lo, unsigned int hi)
+{
+    unsigned int mid = lo + (hi - lo) / 2;
+    uint32_t max = blocklist->subentries[mid].ip_max, m;
+
+    if (lo < mid) {
+        m = submax_node(blocklist, lo, mid);
+        if (m > max)
+            max = m;
+    }
+    if (mid + 1 < hi) {
+        m = submax_node(blocklist, mid + 1, hi);
+        if (m > max)
+            max = m;
+    }
+    blocklist->submax[mid] = max;
+    return max;
+}
+
+static void
+build_submax(blocklist_t* blocklist)
+{
+    unsigned int i;
+
+    blocklist->submax = NULL;
+    if (blocklist->subcount == 0)
+        return;
+    blocklist->submax = arena_alloc(&blocklist->arena,
+        blocklist->subcount * sizeof(uint32_t));
+    for (i = 0; i < blocklist->count; i++) {
+        block_entry2_t* e2 = &blocklist->entries2[i];
+        if (e2->label == LABEL_NONE && e2->merged_count > 0)
+            submax_node(blocklist, e2->merged_idx,
+                e2->merged_idx + e2->merged_count);
+    }
+}
+#endif
+
+/* Merges the overlapping and adjacent ranges of a sorted list in a
+   single pass, compacting the list in place. The merged ranges are
+   listed in the report file if given, or in the debug log. Merged
+   ranges coming from several lists are split afterwards where their
+   list mask changes. */
 void
-blocklist_trim(blocklist_t* blocklist)
+blocklist_trim(blocklist_t* blocklist, FILE* report)
 {
-    unsigned int i, j, k, merged = 0;
+    unsigned int i, j, count = blocklist->count, merged = 0;
+    unsigned int out = 0;
+    int log_merges = report || do_log_enabled(LOG_DEBUG);
 
-    if (blocklist->count == 0)
+    if (count == 0)
         return;
+    PROBE1(trim_start, count);
 
 #ifndef LOWMEM
-    /* pessimistic, will be reallocated later */
-    blocklist->subentries = (block_sub_entry_t*)malloc(blocklist->count * sizeof(block_sub_entry_t));
-    CHECK_OOM(blocklist->subentries);
+    /* pessimistic, the unused part is released later */
+    blocklist->subentries = arena_alloc(&blocklist->arena,
+        count * sizeof(block_sub_entry_t));
     blocklist->subcount = 0;
 #endif
 
-    for (i = 0; i < blocklist->count; i++) {
-        uint32_t ip_max;
-        ip_max = blocklist->entries[i].ip_max;
+    for (i = 0; i < count; i = j) {
+        uint32_t ip_max = blocklist->entries[i].ip_max;
+        block_entry2_t e2 = blocklist->entries2[i];
+
         /* Look if the following entries can be merged with the
          * current one */
-        for (j = i + 1; j < blocklist->count; j++) {
-            if (blocklist->entries[j].ip_min > ip_max + 1)
+        for (j = i + 1; j < count; j++) {
+            if (ip_max != UINT32_MAX && blocklist->entries[j].ip_min > ip_max + 1)
                 break;
             if (blocklist->entries[j].ip_max > ip_max)
                 ip_max = blocklist->entries[j].ip_max;
         }
-        if (j > i + 1) {
-            uint32_t ip1, ip2;
-            char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
-            char* tmp = malloc(32 * (j - i + 1) + 1);
-            CHECK_OOM(tmp);
-            /* List the merged entries */
-            tmp[0] = 0;
-            for (k = i; k < j; k++) {
-                char tmp2[33];
-                ip1 = htonl(blocklist->entries[k].ip_min);
-                ip2 = htonl(blocklist->entries[k].ip_max);
-                inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
-                inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
-                sprintf(tmp2, "%s-%s ", buf1, buf2);
-                strcat(tmp, tmp2);
-            }
-            ip1 = htonl(blocklist->entries[i].ip_min);
-            ip2 = htonl(ip_max);
-            inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
-            inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
-            do_log(LOG_DEBUG, "Merging ranges: %sinto %s-%s", tmp, buf1, buf2);
-            free(tmp);
 
+        if (j > i + 1) {
+            if (log_merges)
+                report_merge(blocklist, i, j, ip_max, report);
 #ifndef LOWMEM
-            /* Copy the sub-entries and mark the unneeded entries */
-            blocklist->entries2[i].merged_idx = blocklist->subcount;
+            unsigned int k;
+
+            /* Copy the sub-entries */
+            e2.merged_idx = blocklist->subcount;
+            e2.merged_count = j - i;
+            e2.label = LABEL_NONE;
+            e2.lists = 0;
             for (k = i; k < j; k++) {
-                blocklist->subentries[blocklist->subcount].ip_min = blocklist->entries[k].ip_min;
-                blocklist->subentries[blocklist->subcount].ip_max = blocklist->entries[k].ip_max;
-                blocklist->subentries[blocklist->subcount].name = blocklist->entries2[k].name;
-                blocklist->subcount++;
-                if (k > i)
-                    blocklist->entries2[k].hits = -1;
+                block_sub_entry_t* s = &blocklist->subentries[blocklist->subcount++];
+                s->ip_min = blocklist->entries[k].ip_min;
+                s->ip_max = blocklist->entries[k].ip_max;
+                s->label = blocklist->entries2[k].label;
+                s->lists = blocklist->entries2[k].lists;
+                e2.lists |= s->lists;
             }
-            blocklist->entries2[i].name = 0;
-#else
-            for (k = i + 1; k < j; k++)
-                if (k > i)
-                    blocklist->entries2[k].hits = -1;
 #endif
-            /* Extend the range */
-            blocklist->entries[i].ip_max = ip_max;
             merged += j - i - 1;
-            i = j - 1;
         }
+
+        /* out <= i, so nothing unread gets overwritten */
+        blocklist->entries[out].ip_min = blocklist->entries[i].ip_min;
+        blocklist->entries[out].ip_max = ip_max;
+        blocklist->entries2[out] = e2;
+        out++;
     }
+    blocklist->count = out;
+    PROBE2(trim_merged, out, merged);
 
-    /* Squish the list */
-    if (merged) {
-        for (i = 0, j = 0; i < blocklist->count; i++) {
-            if (blocklist->entries2[i].hits >= 0) {
-                if (i != j) {
-                    memcpy(blocklist->entries + j, blocklist->entries + i, sizeof(block_entry_t));
-                    memcpy(blocklist->entries2 + j, blocklist->entries2 + i, sizeof(block_entry2_t));
-                }
-                j++;
-            }
-        }
-        blocklist->count -= merged;
+    if (merged)
         do_log(LOG_DEBUG, "%d entries merged", merged);
-    }
 
+    /* give the unused tails back to the system */
+    arena_release(&blocklist->arena, blocklist->entries + blocklist->count,
+        (blocklist->size - blocklist->count) * sizeof(block_entry_t));
+    arena_release(&blocklist->arena, blocklist->entries2 + blocklist->count,
+        (blocklist->size - blocklist->count) * sizeof(block_entry2_t));
 #ifndef LOWMEM
-    if (blocklist->count) {
-        blocklist->entries = realloc(blocklist->entries, blocklist->count * sizeof(block_entry_t));
-        blocklist->entries2 = realloc(blocklist->entries2, blocklist->count * sizeof(block_entry2_t));
-        CHECK_OOM(blocklist->entries);
-        CHECK_OOM(blocklist->entries2);
-    } else {
-        free(blocklist->entries);
-        free(blocklist->entries2);
-        blocklist->entries = 0;
-        blocklist->entries2 = 0;
-    }
-    if (blocklist->subcount) {
-        blocklist->subentries = (block_sub_entry_t*)realloc(blocklist->subentries, blocklist->subcount * sizeof(block_sub_entry_t));
-        CHECK_OOM(blocklist->subentries);
-    } else {
-        free(blocklist->subentries);
-        blocklist->subentries = 0;
-    }
+    arena_release(&blocklist->arena, blocklist->subentries + blocklist->subcount,
+        (count - blocklist->subcount) * sizeof(block_sub_entry_t));
+    build_submax(blocklist);
+#endif
+    blocklist->size = blocklist->count;
+
+#ifndef LOWMEM
+    blocklist_split(blocklist);
 #endif
+    PROBE1(trim_done, blocklist->count);
+}
+
+/* Removes the ranges of another sorted and trimmed list, e.g. an
+   allowlist, from a sorted and trimmed list. The pieces of a split
+   range keep its entries2 data, including the sub-entries. */
+void
+blocklist_subtract(blocklist_t* blocklist, const blocklist_t* other)
+{
+    unsigned int i, n, max = blocklist->count + other->count;
+    block_entry_t* entries;
+    block_entry2_t* entries2;
+    unsigned int* origin;
+
+    if (blocklist->count == 0 || other->count == 0)
+        return;
+
+    entries = arena_alloc(&blocklist->arena, sizeof(block_entry_t) * max);
+    origin = arena_alloc(&blocklist->arena, sizeof(unsigned int) * max);
+    n = range_subtract(blocklist->entries, blocklist->count,
+        other->entries, other->count, entries, origin);
+
+    entries2 = arena_alloc(&blocklist->arena, sizeof(block_entry2_t) * n);
+    for (i = 0; i < n; i++)
+        entries2[i] = blocklist->entries2[origin[i]];
+
+    arena_release(&blocklist->arena, blocklist->entries, sizeof(block_entry_t) * blocklist->size);
+    arena_release(&blocklist->arena, blocklist->entries2, sizeof(block_entry2_t) * blocklist->size);
+    arena_release(&blocklist->arena, entries + n, sizeof(block_entry_t) * (max - n));
+    arena_release(&blocklist->arena, origin, sizeof(unsigned int) * max);
+    blocklist->entries = entries;
+    blocklist->entries2 = entries2;
+    blocklist->count = blocklist->size = n;
 }
 
 #ifndef LOWMEM
-static int
-compare_hits(const void* p1, const void* p2)
+/* Counts the sub-entries overlapping a composite entry, and stores the
+   first of them. The pieces of a range split by list or by
+   blocklist_subtract() share the sub-entries of the whole range. */
+static unsigned int
+count_subentries(blocklist_t* blocklist, unsigned int idx, block_sub_entry_t** first)
 {
-    return (*(block_entry2_t**)p2)->hits - (*(block_entry2_t**)p1)->hits;
+    block_entry_t* e = &blocklist->entries[idx];
+    block_entry2_t* e2 = &blocklist->entries2[idx];
+    unsigned int k, n = 0;
+
+    for (k = e2->merged_idx; k < e2->merged_idx + e2->merged_count; k++) {
+        block_sub_entry_t* s = &blocklist->subentries[k];
+        if (s->ip_max < e->ip_min || s->ip_min > e->ip_max)
+            continue;
+        if (n++ == 0)
+            *first = s;
+    }
+    return n;
 }
 #endif
 
-void
-blocklist_stats(blocklist_t* blocklist)
+typedef struct hit_item_t {
+    uint64_t hits;
+    unsigned int idx;
+} hit_item_t;
+
+/* Restores the min-heap below pos, the least hit entry is on the top */
+static void
+hits_sift_down(hit_item_t* heap, unsigned int n, unsigned int pos)
+{
+    hit_item_t item = heap[pos];
+    unsigned int child;
+
+    while ((child = 2 * pos + 1) < n) {
+        if (child + 1 < n && heap[child + 1].hits < heap[child].hits)
+            child++;
+        if (heap[child].hits >= item.hits)
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = item;
+}
+
+static void
+hits_heapify(hit_item_t* heap, unsigned int n)
 {
     unsigned int i;
-    unsigned long total = 0;
 
-#ifndef LOWMEM
-    block_entry2_t** sorted_entries2;
-    unsigned int entry_count = 0;
-
-    for (i = 0; i < blocklist->count; i++)
-        if (blocklist->entries2[i].hits >= 1)
-            entry_count++;
-
-    sorted_entries2 = (block_entry2_t**)malloc(sizeof(block_entry2_t*) * entry_count);
-    CHECK_OOM(sorted_entries2);
-    for (i = 0, entry_count = 0; i < blocklist->count; i++) {
-        if (blocklist->entries2[i].hits >= 1)
-            sorted_entries2[entry_count++] = &blocklist->entries2[i];
+    for (i = n / 2; i > 0; i--)
+        hits_sift_down(heap, n, i - 1);
+}
+
+/* Logs the top most hit entries, or all of them if top is 0. They are
+   selected with a heap of top entries, so that a long list with few
+   lines shown does not need to be sorted as a whole. */
+void
+blocklist_stats(blocklist_t* blocklist, const uint64_t* hits, unsigned int top)
+{
+    unsigned int i, entry_count = 0, hit_count = 0;
+    uint64_t total = 0;
+    hit_item_t* items;
+
+    if (top == 0 || top > blocklist->count)
+        top = blocklist->count;
+    items = (hit_item_t*)malloc(sizeof(hit_item_t) * (top ? top : 1));
+    CHECK_OOM(items);
+    for (i = 0; i < blocklist->count; i++) {
+        if (hits[i] == 0)
+            continue;
+        total += hits[i];
+        hit_count++;
+        if (entry_count < top) {
+            items[entry_count].hits = hits[i];
+            items[entry_count++].idx = i;
+            if (entry_count == top)
+                hits_heapify(items, entry_count);
+        } else if (hits[i] > items[0].hits) {
+            items[0].hits = hits[i];
+            items[0].idx = i;
+            hits_sift_down(items, entry_count, 0);
+        }
+    }
+    if (entry_count < top)
+        hits_heapify(items, entry_count);
+    // popping the least hit ones to the end sorts them from the most hit
+    for (i = entry_count; i > 1; i--) {
+        hit_item_t tmp = items[0];
+        items[0] = items[i - 1];
+        items[i - 1] = tmp;
+        hits_sift_down(items, i - 1, 0);
     }
-    qsort(sorted_entries2, entry_count, sizeof(block_entry2_t*), compare_hits);
-#else
-    unsigned int entry_count = blocklist->count;
-#endif
 
     do_log(LOG_INFO, "Blocker hit statistic:");
     for (i = 0; i < entry_count; i++) {
+        block_entry_t* e = &blocklist->entries[items[i].idx];
+        uint32_t ip1, ip2;
+        char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
+
+        ip1 = htonl(e->ip_min);
+        ip2 = htonl(e->ip_max);
+        inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
+        inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
 #ifndef LOWMEM
-        block_entry2_t* e2 = sorted_entries2[i];
-        block_entry_t* e = &blocklist->entries[e2 - blocklist->entries2];
-#else
-        block_entry2_t* e2 = &blocklist->entries2[i];
-        block_entry_t* e = &blocklist->entries[i];
-#endif
-        if (e2->hits >= 1) {
-            uint32_t ip1, ip2;
-            char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
-            ip1 = htonl(e->ip_min);
-            ip2 = htonl(e->ip_max);
-            inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
-            inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
-#ifndef LOWMEM
-            if (e2->name) {
-                do_log(LOG_INFO, "%s - %s-%s: %d", e2->name,
-                    buf1, buf2, e2->hits);
-            } else {
-                unsigned int j, cnt;
-                block_sub_entry_t* s;
-                cnt = 0;
-                for (j = e2->merged_idx; j < blocklist->subcount; j++) {
-                    s = &blocklist->subentries[j];
-                    if (s->ip_max > e->ip_max)
-                        break;
-                    cnt++;
-                }
-                s = &blocklist->subentries[e2->merged_idx];
-                do_log(LOG_INFO, "%s [+%d] - %s-%s: %d", s->name, cnt - 1,
-                    buf1, buf2, e2->hits);
-            }
+        block_entry2_t* e2 = &blocklist->entries2[items[i].idx];
+        if (e2->label != LABEL_NONE) {
+            do_log(LOG_INFO, "%s - %s-%s: %" PRIu64,
+                label_get(&blocklist->labels, e2->label),
+                buf1, buf2, items[i].hits);
+        } else {
+            block_sub_entry_t* s = &blocklist->subentries[e2->merged_idx];
+            unsigned int n = count_subentries(blocklist, items[i].idx, &s);
+            do_log(LOG_INFO, "%s [+%d] - %s-%s: %" PRIu64,
+                label_get(&blocklist->labels, s->label), n - 1,
+                buf1, buf2, items[i].hits);
+        }
 #else
-            do_log(LOG_INFO, "%s-%s: %d", buf1, buf2, e2->hits);
+        do_log(LOG_INFO, "%s-%s: %" PRIu64, buf1, buf2, items[i].hits);
 #endif
-            total += e2->hits;
-        }
     }
-    do_log(LOG_INFO, "%ld hits total", total);
-#ifndef LOWMEM
-    free(sorted_entries2);
-#endif
+    if (hit_count > entry_count)
+        do_log(LOG_INFO, "%u more ranges hit", hit_count - entry_count);
+    do_log(LOG_INFO, "%" PRIu64 " hits total", total);
+    free(items);
 }
 
 block_entry_t*
@@ -381,15 +819,49 @@ search_key(blocklist_t* blocklist, const void* key)
     return NULL;
 }
 
-#ifndef LOWMEM
+/* Looks up n addresses at once. The searches advance in lockstep, so
+   the cache misses of the independent searches overlap. */
+void
+blocklist_find_batch(blocklist_t* blocklist, const uint32_t* ips,
+    unsigned int n, block_entry2_t** found)
+{
+    block_entry_t* base[FIND_BATCH];
+    unsigned int i, start, len;
+
+    for (start = 0; start < n; start += FIND_BATCH) {
+        unsigned int cnt = n - start < FIND_BATCH ? n - start : FIND_BATCH;
+        const uint32_t* ip = ips + start;
+
+        if (blocklist->count == 0) {
+            for (i = 0; i < cnt; i++)
+                found[start + i] = NULL;
+            continue;
+        }
+        for (i = 0; i < cnt; i++)
+            base[i] = blocklist->entries;
+        // find the last range starting at or below each address
+        for (len = blocklist->count; len > 1; len -= len / 2) {
+            unsigned int half = len / 2;
+            for (i = 0; i < cnt; i++) {
+                __builtin_prefetch(base[i] + half / 2);
+                __builtin_prefetch(base[i] + half + half / 2);
+                base[i] = base[i][half].ip_min <= ip[i] ? base[i] + half : base[i];
+            }
+        }
+        for (i = 0; i < cnt; i++) {
+            if (base[i]->ip_min <= ip[i] && base[i]->ip_max >= ip[i])
+                found[start + i] = &blocklist->entries2[base[i] - blocklist->entries];
+            else
+                found[start + i] = NULL;
+        }
+    }
+}
+
 block_entry2_t*
-blocklist_find(blocklist_t* blocklist, uint32_t ip,
-    const char** names, unsigned int max)
+blocklist_find(blocklist_t* blocklist, uint32_t ip)
 {
     block_entry_t e;
     block_entry_t* ret;
-    block_entry2_t* ret2;
-    unsigned int i, cnt;
 
     e.ip_min = e.ip_max = ip;
     ret = search_key(blocklist, &e);
@@ -397,53 +869,58 @@ blocklist_find(blocklist_t* blocklist, uint32_t ip,
         // entry not found
         return 0;
 
-    ret2 = &blocklist->entries2[ret - blocklist->entries];
-    if (!names)
-        goto out;
+    return &blocklist->entries2[ret - blocklist->entries];
+}
+
+#ifndef LOWMEM
+/* In-order walk of the sub-entries [lo, hi) containing ip, skipping
+   the subtrees whose highest ip_max is below it and stopping at the
+   first sub-entry starting above it. Returns 0 once nothing further
+   can match, so the results stay sorted and truncated at max. */
+static int
+names_query(blocklist_t* blocklist, unsigned int lo, unsigned int hi,
+    uint32_t ip, const char** names, unsigned int* cnt, unsigned int max)
+{
+    while (lo < hi && *cnt < max) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        block_sub_entry_t* e = &blocklist->subentries[mid];
+
+        if (blocklist->submax[mid] < ip)
+            return 1;
+        if (!names_query(blocklist, lo, mid, ip, names, cnt, max))
+            return 0;
+        if (e->ip_min > ip || *cnt >= max)
+            return 0;
+        if (e->ip_max >= ip)
+            names[(*cnt)++] = label_get(&blocklist->labels, e->label);
+        lo = mid + 1;
+    }
+    return lo >= hi;
+}
+
+unsigned int
+blocklist_names(blocklist_t* blocklist, const block_entry2_t* e2, uint32_t ip,
+    const char** names, unsigned int max)
+{
+    unsigned int cnt;
 
-    if (ret2->name) {
+    if (e2->label != LABEL_NONE) {
         // entry found, no subentries
-        names[0] = ret2->name;
+        names[0] = label_get(&blocklist->labels, e2->label);
         names[1] = 0;
-        goto out;
+        return 1;
     }
 
-    // scan the subentries
+    // walk the interval tree of the subentries, in order
     cnt = 0;
-    for (i = ret2->merged_idx; i < blocklist->subcount; i++) {
-        block_sub_entry_t* e = &blocklist->subentries[i];
-        if (e->ip_min > ret->ip_max)
-            break;
-        if (cnt >= max)
-            break;
-        if (e->ip_min <= ip && e->ip_max >= ip)
-            names[cnt++] = e->name;
-    }
+    names_query(blocklist, e2->merged_idx, e2->merged_idx + e2->merged_count,
+        ip, names, &cnt, max);
 
     if (cnt == 0)
         do_log(LOG_ERR, "No sub-entries found, should not happen!");
 
     names[cnt] = 0;
-
-out:
-    return ret2;
-}
-#else
-block_entry2_t*
-blocklist_find(blocklist_t* blocklist, uint32_t ip,
-    void* dummy1, int dummy2)
-{
-    block_entry_t e;
-    block_entry_t* ret;
-
-    e.ip_min = e.ip_max = ip;
-    ret = bsearch(blocklist, &e);
-
-    if (!ret)
-        // entry not found
-        return 0;
-
-    return &blocklist->entries2[ret - blocklist->entries];
+    return cnt;
 }
 #endif
 
@@ -465,23 +942,26 @@ blocklist_dump(blocklist_t* blocklist)
         inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
         inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
 #ifndef LOWMEM
-        if (e2->name) {
-            printf("%d - %s-%s - %s\n", i, buf1, buf2, e2->name);
+        if (e2->label != LABEL_NONE) {
+            printf("%d - %s-%s - %s\n", i, buf1, buf2,
+                label_get(&blocklist->labels, e2->label));
         } else {
             unsigned int j;
             printf("%d - %s-%s is a composite range:\n", i, buf1, buf2);
-            for (j = e2->merged_idx; j < blocklist->subcount; j++) {
+            for (j = e2->merged_idx; j < e2->merged_idx + e2->merged_count; j++) {
                 block_sub_entry_t* s = &blocklist->subentries[j];
                 if (s->ip_min > e->ip_max)
                     break;
+                /* ranges split by blocklist_subtract() share the
+                   sub-entries of the original composite range */
+                if (s->ip_max < e->ip_min)
+                    continue;
                 ip1 = htonl(s->ip_min);
                 ip2 = htonl(s->ip_max);
                 inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
                 inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
-                printf("  Sub-Range: %s-%s - %s\n", buf1, buf2, s->name);
-                if (s->ip_max > e->ip_max) {
-                    printf("  Partial overlap, should not happen!\n");
-                }
+                printf("  Sub-Range: %s-%s - %s\n", buf1, buf2,
+                    label_get(&blocklist->labels, s->label));
             }
         }
 #else
@@ -25,30 +25,21 @@
 #define BLOCKLIST_H
 
 #include <inttypes.h>
+#include <stdio.h>
 #include <time.h>
 
-/* iconv is not needed in LOWMEM mode (no strings handled) */
-#ifndef LOWMEM
-#include <iconv.h>
-#else
-typedef int iconv_t;
-static inline iconv_t
-iconv_open(const char* tocode, const char* fromcode)
-{
-    return 0;
-}
-static inline int
-iconv_close(iconv_t cd)
-{
-    return 0;
-}
-#endif
+#include "arena.h"
+#include "labels.h"
 
 #define MAX_LABEL_LENGTH 255
 
+/* number of lists distinguished in the list masks */
+#define MAX_LISTS 32
+
 #ifndef LOWMEM
 typedef struct block_sub_entry_t {
-    char* name;
+    uint32_t label;
+    uint32_t lists;
     uint32_t ip_min, ip_max;
 } block_sub_entry_t;
 #endif
@@ -57,19 +48,25 @@ typedef struct block_entry_t {
     uint32_t ip_min, ip_max;
 } block_entry_t;
 
+/* Read-only once the list is trimmed, the hit counters are kept by
+   the caller in arrays indexed the same way as the entries */
 typedef struct block_entry2_t {
 #ifndef LOWMEM
-    char* name;
+    /* LABEL_NONE for composite ranges */
+    uint32_t label;
 #endif
-
-    int hits;
+    /* mask of the lists containing the whole range */
+    uint32_t lists;
 #ifndef LOWMEM
     int merged_idx;
+    unsigned int merged_count;
 #endif
-    time_t lasttime;
 } block_entry2_t;
 
 typedef struct blocklist_t {
+    /* holds all the memory below but the labels */
+    arena_t arena;
+
     block_entry_t* entries;
     block_entry2_t* entries2;
     unsigned int count, size;
@@ -77,24 +74,46 @@ typedef struct blocklist_t {
 #ifndef LOWMEM
     block_sub_entry_t* subentries;
     unsigned int subcount;
+    /* implicit interval tree over the sub-entries of each composite:
+       the highest ip_max below every midpoint, see blocklist_names */
+    uint32_t* submax;
+
+    label_pool_t labels;
+    /* the pool grows while the entries are appended, in an arena of
+       its own it does not get in the way of growing them in place */
+    arena_t label_arena;
 #endif
+
+    /* list the appended entries belong to, 0 - MAX_LISTS-1 */
+    unsigned int list;
 } blocklist_t;
 
 void blocklist_init(blocklist_t* blocklist);
+void blocklist_reserve(blocklist_t* blocklist, unsigned int count);
+/* name is expected to be in UTF-8 */
 void blocklist_append(blocklist_t* blocklist,
     uint32_t ip_min, uint32_t ip_max,
-    const char* name, iconv_t ic);
+    const char* name);
 void blocklist_clear(blocklist_t* blocklist, int start);
-void blocklist_sort(blocklist_t* blocklist);
-void blocklist_trim(blocklist_t* blocklist);
-void blocklist_stats(blocklist_t* blocklist);
+void blocklist_truncate(blocklist_t* blocklist, unsigned int count);
+void blocklist_sort(blocklist_t* blocklist, int threads);
+void blocklist_trim(blocklist_t* blocklist, FILE* report);
+void blocklist_subtract(blocklist_t* blocklist, const blocklist_t* other);
+/* hits holds a counter for each entry, only the top most hit entries
+   are listed, all of them if top is 0 */
+void blocklist_stats(blocklist_t* blocklist, const uint64_t* hits, unsigned int top);
+block_entry2_t* blocklist_find(blocklist_t* blocklist, uint32_t ip);
 #ifndef LOWMEM
-block_entry2_t* blocklist_find(blocklist_t* blocklist, uint32_t ip,
-    const char** names, unsigned int max);
-#else
-block_entry2_t* blocklist_find(blocklist_t* blocklist, uint32_t ip,
-    void* dummy1, unsigned int dummy2);
+/* Fills names with the labels of the ranges of the entry e2 found for
+   ip, at most max of them, and a terminating NULL. Only needed when
+   the hit is reported, the lookup itself does not touch the labels. */
+unsigned int blocklist_names(blocklist_t* blocklist, const block_entry2_t* e2,
+    uint32_t ip, const char** names, unsigned int max);
 #endif
+/* addresses looked up together by blocklist_find_batch() */
+#define FIND_BATCH 16
+void blocklist_find_batch(blocklist_t* blocklist, const uint32_t* ips,
+    unsigned int n, block_entry2_t** found);
 void blocklist_dump(blocklist_t* blocklist);
 
 #endif
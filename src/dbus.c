@@ -35,6 +35,12 @@ nfblock_dbus_init(log_func_t do_log)
     DBusError dberr;
     int req;
 
+    /* the connection is set up here, but used by the sending thread */
+    if (!dbus_threads_init_default()) {
+        do_log(LOG_ERR, "Cannot initialize D-Bus threading.");
+        return -1;
+    }
+
     dbus_error_init(&dberr);
     dbconn = dbus_bus_get(DBUS_BUS_SYSTEM, &dberr);
     if (dbus_error_is_set(&dberr)) {
@@ -68,7 +74,8 @@ nfblock_dbus_message_append_blocked(DBusMessage* dbmsg,
     const char** ranges,
     uint32_t hits,
     dbus_bool_t dropped,
-    time_t curtime)
+    time_t curtime,
+    uint32_t count)
 {
     DBusMessageIter dbiter;
     dbus_bool_t dbb = TRUE;
@@ -91,6 +98,8 @@ nfblock_dbus_message_append_blocked(DBusMessage* dbmsg,
     dbb &= dbus_message_iter_append_basic(&dbiter, DBUS_TYPE_UINT32, &hits);
     /* dropped */
     dbb &= dbus_message_iter_append_basic(&dbiter, DBUS_TYPE_BOOLEAN, &dropped);
+    /* number of coalesced events */
+    dbb &= dbus_message_iter_append_basic(&dbiter, DBUS_TYPE_UINT32, &count);
 
     return dbb;
 }
@@ -99,7 +108,7 @@ int
 nfblock_dbus_send_blocked(log_func_t do_log, time_t curtime,
     dbus_log_message_t signal, bool dropped,
     char* addr, const char** ranges,
-    uint32_t hits)
+    uint32_t hits, uint32_t count)
 {
     DBusMessage* dbmsg = NULL;
     dbus_bool_t dbb = TRUE;
@@ -130,7 +139,7 @@ nfblock_dbus_send_blocked(log_func_t do_log, time_t curtime,
         return -1;
 
     dbb &= nfblock_dbus_message_append_blocked(dbmsg, addr, ranges,
-        hits, dropped, curtime);
+        hits, dropped, curtime, count);
 
     if (dbb && dbus_connection_get_is_connected(dbconn)) {
         dbus_connection_send(dbconn, dbmsg, NULL);
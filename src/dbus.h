@@ -45,10 +45,11 @@ typedef enum {
 
 typedef int (*nfblock_dbus_init_t)(log_func_t do_log);
 
+/* count is the number of blocked events the signal stands for */
 typedef int (*nfblock_dbus_send_blocked_t)(log_func_t do_log, time_t curtime,
     dbus_log_message_t signal,
     dbus_bool_t dropped, char* addr,
     const char** ranges,
-    uint32_t hits);
+    uint32_t hits, uint32_t count);
 
 #endif
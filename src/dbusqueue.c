@@ -0,0 +1,252 @@
+/*
+   Queue of the D-Bus blocked signals
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "dbusqueue.h"
+#include "probes.h"
+#include "ring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <syslog.h>
+
+typedef struct dbus_event_t {
+    time_t time;
+    uint64_t hits;
+    uint8_t signal;
+    uint8_t dropped;
+    char addr[INET_ADDRSTRLEN];
+    char label[DBUSQ_LABEL_SIZE];
+} dbus_event_t;
+
+/* events of one range waiting for the end of the window */
+typedef struct pending_event_t {
+    dbus_event_t ev;
+    uint32_t count;
+    int used;
+} pending_event_t;
+
+static ring_t ring;
+static sem_t wakeup;
+static pthread_t thread;
+static int running = 0, stopping = 0;
+
+static nfblock_dbus_send_blocked_t send_func;
+static log_func_t log_func;
+
+/* only touched by the sending thread */
+static pending_event_t pending[DBUSQ_PENDING];
+static double tokens, rate;
+static struct timespec refilled;
+
+static uint64_t queued, coalesced, throttled, sent;
+
+static int
+take_token(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tokens += rate * ((now.tv_sec - refilled.tv_sec) + (now.tv_nsec - refilled.tv_nsec) / 1e9);
+    // allow a burst of one second worth of signals
+    if (tokens > rate)
+        tokens = rate;
+    refilled = now;
+    if (tokens < 1.0)
+        return 0;
+    tokens -= 1.0;
+    return 1;
+}
+
+static void
+send_event(dbus_event_t* ev, uint32_t count)
+{
+    const char* ranges[2] = { ev->label, NULL };
+
+    if (!take_token()) {
+        __atomic_store_n(&throttled, throttled + 1, __ATOMIC_RELAXED);
+        PROBE3(dbus_throttled, ev->signal, ev->addr, count);
+        return;
+    }
+    send_func(log_func, ev->time, ev->signal, ev->dropped, ev->addr, ranges,
+        (uint32_t)ev->hits, count);
+    PROBE4(dbus_emit, ev->signal, ev->addr, ev->label, count);
+    __atomic_store_n(&sent, sent + 1, __ATOMIC_RELAXED);
+}
+
+/* Merges the event with a pending one of the same range, or starts
+   a new window for it */
+static void
+add_event(dbus_event_t* ev)
+{
+    pending_event_t* free_slot = NULL;
+    int i;
+
+    for (i = 0; i < DBUSQ_PENDING; i++) {
+        pending_event_t* p = &pending[i];
+        if (!p->used) {
+            if (!free_slot)
+                free_slot = p;
+        } else if (p->ev.signal == ev->signal && !strcmp(p->ev.label, ev->label)) {
+            p->count++;
+            p->ev.hits = ev->hits;
+            p->ev.dropped |= ev->dropped;
+            memcpy(p->ev.addr, ev->addr, sizeof(ev->addr));
+            __atomic_store_n(&coalesced, coalesced + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    if (!free_slot) {
+        // too many ranges at once, no coalescing
+        send_event(ev, 1);
+        return;
+    }
+    free_slot->ev = *ev;
+    free_slot->count = 1;
+    free_slot->used = 1;
+}
+
+/* Sends the events whose window ended before now (all of them if all
+   is set), returns the end of the earliest remaining window, or 0 */
+static time_t
+flush_events(time_t now, int all)
+{
+    time_t next = 0;
+    int i;
+
+    for (i = 0; i < DBUSQ_PENDING; i++) {
+        pending_event_t* p = &pending[i];
+        time_t end;
+        if (!p->used)
+            continue;
+        end = p->ev.time + DBUSQ_WINDOW;
+        if (all || end <= now) {
+            send_event(&p->ev, p->count);
+            p->used = 0;
+        } else if (!next || end < next) {
+            next = end;
+        }
+    }
+    return next;
+}
+
+static void*
+dbusq_loop(void* arg)
+{
+    dbus_event_t* ev;
+    time_t next;
+
+    for (;;) {
+        while ((ev = ring_peek(&ring))) {
+            add_event(ev);
+            ring_consume(&ring);
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            flush_events(0, 1);
+            break;
+        }
+        next = flush_events(time(NULL), 0);
+        if (next) {
+            struct timespec ts = { next, 0 };
+            while (sem_timedwait(&wakeup, &ts) != 0 && errno == EINTR)
+                ;
+        } else {
+            while (sem_wait(&wakeup) != 0)
+                ;
+        }
+    }
+    return NULL;
+}
+
+int
+dbusq_start(nfblock_dbus_send_blocked_t send, log_func_t log, unsigned int signal_rate)
+{
+    if (ring_init(&ring, DBUSQ_SIZE, sizeof(dbus_event_t)) < 0)
+        return -1;
+    send_func = send;
+    log_func = log;
+    rate = signal_rate ? signal_rate : 1;
+    tokens = rate;
+    clock_gettime(CLOCK_MONOTONIC, &refilled);
+    memset(pending, 0, sizeof(pending));
+    stopping = 0;
+    sem_init(&wakeup, 0, 0);
+    if (pthread_create(&thread, NULL, dbusq_loop, NULL) != 0) {
+        sem_destroy(&wakeup);
+        ring_free(&ring);
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+dbusq_stop(void)
+{
+    if (!running)
+        return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&wakeup);
+    pthread_join(thread, NULL);
+    sem_destroy(&wakeup);
+    ring_free(&ring);
+}
+
+void
+dbusq_push(time_t curtime, dbus_log_message_t signal, int dropped,
+    const char* addr, const char* label, uint64_t hits)
+{
+    dbus_event_t* ev;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+    ev = ring_reserve(&ring);
+    if (!ev)
+        return;
+    ev->time = curtime;
+    ev->hits = hits;
+    ev->signal = signal;
+    ev->dropped = dropped;
+    strncpy(ev->addr, addr, sizeof(ev->addr) - 1);
+    ev->addr[sizeof(ev->addr) - 1] = 0;
+    // the range may have no name
+    strncpy(ev->label, label ? label : "", sizeof(ev->label) - 1);
+    ev->label[sizeof(ev->label) - 1] = 0;
+    ring_commit(&ring, ev);
+    __atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED);
+    sem_post(&wakeup);
+}
+
+void
+dbusq_stats(log_func_t log)
+{
+    log(LOG_INFO, "D-Bus: %" PRIu64 " events queued, %" PRIu64 " dropped, %" PRIu64
+        " coalesced, %" PRIu64 " throttled, %" PRIu64 " signals sent",
+        __atomic_load_n(&queued, __ATOMIC_RELAXED),
+        __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED),
+        __atomic_load_n(&coalesced, __ATOMIC_RELAXED),
+        __atomic_load_n(&throttled, __ATOMIC_RELAXED),
+        __atomic_load_n(&sent, __ATOMIC_RELAXED));
+}
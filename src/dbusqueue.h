@@ -0,0 +1,49 @@
+/*
+   Queue of the D-Bus blocked signals
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef DBUSQUEUE_H
+#define DBUSQUEUE_H
+
+#include "dbus.h"
+
+/* queued events */
+#define DBUSQ_SIZE 1024
+/* the events of one range within this many seconds make one signal */
+#define DBUSQ_WINDOW 2
+/* ranges coalesced at once */
+#define DBUSQ_PENDING 64
+#define DBUSQ_LABEL_SIZE 96
+
+/* Starts the thread sending the signals with send, at most rate
+   signals per second */
+int dbusq_start(nfblock_dbus_send_blocked_t send, log_func_t log, unsigned int rate);
+/* Sends the remaining events and stops the thread, once nothing
+   pushes any more events */
+void dbusq_stop(void);
+/* Queues a blocked event for sending, never blocks. If the queue is
+   full, the event is counted and dropped. */
+void dbusq_push(time_t curtime, dbus_log_message_t signal, int dropped,
+    const char* addr, const char* label, uint64_t hits);
+void dbusq_stats(log_func_t log);
+
+#endif
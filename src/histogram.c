@@ -0,0 +1,104 @@
+/*
+   Log-linear histograms
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "histogram.h"
+
+static unsigned int
+bucket_index(uint64_t value)
+{
+    unsigned int e;
+
+    if (value < HIST_SUB)
+        return value;
+    e = 63 - __builtin_clzll(value);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB
+        + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the highest value falling into the bucket */
+static uint64_t
+bucket_max(unsigned int idx)
+{
+    unsigned int e;
+
+    if (idx < HIST_SUB)
+        return idx;
+    e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB + idx % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void
+histogram_add(histogram_t* h, uint64_t value)
+{
+    unsigned int idx = bucket_index(value);
+
+    __atomic_store_n(&h->counts[idx], h->counts[idx] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+}
+
+void
+histogram_merge(histogram_t* dst, const histogram_t* src)
+{
+    uint64_t count = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t c = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+        dst->counts[i] += c;
+        count += c;
+    }
+    // the buckets, not the separately updated total, so that both agree
+    dst->count += count;
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+uint64_t
+histogram_count_below(const histogram_t* h, unsigned int bits)
+{
+    unsigned int i, end;
+    uint64_t count = 0;
+
+    if (bits >= 64)
+        return h->count;
+    end = bucket_index((uint64_t)1 << bits);
+    for (i = 0; i < end; i++)
+        count += h->counts[i];
+    return count;
+}
+
+uint64_t
+histogram_percentile(const histogram_t* h, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * h->count + 0.5), seen = 0;
+    unsigned int i;
+
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return bucket_max(i);
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+   Log-linear histograms
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <inttypes.h>
+
+/* Values below HIST_SUB have a bucket each, above that each power of 2
+   is split into HIST_SUB buckets, so a bucket is at most 1/HIST_SUB
+   of its values wide */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Updated by a single thread with relaxed stores, others can read it
+   meanwhile */
+typedef struct histogram_t {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count, sum;
+} histogram_t;
+
+void histogram_add(histogram_t* h, uint64_t value);
+/* Adds the counts of src to dst, src can be being updated */
+void histogram_merge(histogram_t* dst, const histogram_t* src);
+/* Number of the values below 2^bits */
+uint64_t histogram_count_below(const histogram_t* h, unsigned int bits);
+/* Upper bound of the value below which the given fraction of the
+   values lies, e.g. 0.99 */
+uint64_t histogram_percentile(const histogram_t* h, double fraction);
+
+#endif
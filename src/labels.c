@@ -0,0 +1,108 @@
+/*
+   Label pool
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "labels.h"
+#include <string.h>
+
+#define INITIAL_DATA_SIZE 65536
+#define INITIAL_TABLE_SIZE 4096
+
+/* The pool memory belongs to the arena and is freed together with it */
+void
+label_pool_init(label_pool_t* pool, arena_t* arena)
+{
+    pool->arena = arena;
+    pool->data = NULL;
+    pool->used = pool->size = 0;
+    pool->table = NULL;
+    pool->count = pool->table_size = 0;
+}
+
+static uint32_t
+label_hash(const char* name, size_t* len)
+{
+    const unsigned char* p = (const unsigned char*)name;
+    uint32_t h = 2166136261U;
+
+    while (*p) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    *len = p - (const unsigned char*)name;
+    return h;
+}
+
+static void
+label_table_grow(label_pool_t* pool)
+{
+    uint32_t *old = pool->table, old_size = pool->table_size, i;
+    size_t len;
+
+    pool->table_size = old_size ? old_size * 2 : INITIAL_TABLE_SIZE;
+    pool->table = arena_alloc(pool->arena, sizeof(uint32_t) * pool->table_size);
+    memset(pool->table, 0xff, sizeof(uint32_t) * pool->table_size);
+
+    for (i = 0; i < old_size; i++) {
+        uint32_t id = old[i], slot;
+        if (id == LABEL_NONE)
+            continue;
+        slot = label_hash(pool->data + id, &len) & (pool->table_size - 1);
+        while (pool->table[slot] != LABEL_NONE)
+            slot = (slot + 1) & (pool->table_size - 1);
+        pool->table[slot] = id;
+    }
+    if (old)
+        arena_release(pool->arena, old, sizeof(uint32_t) * old_size);
+}
+
+uint32_t
+label_intern(label_pool_t* pool, const char* name)
+{
+    uint32_t slot, id;
+    size_t len;
+
+    /* keep the load factor below 1/2 */
+    if (pool->count * 2 >= pool->table_size)
+        label_table_grow(pool);
+
+    slot = label_hash(name, &len) & (pool->table_size - 1);
+    while ((id = pool->table[slot]) != LABEL_NONE) {
+        if (strcmp(pool->data + id, name) == 0)
+            return id;
+        slot = (slot + 1) & (pool->table_size - 1);
+    }
+
+    if (pool->used + len + 1 > pool->size) {
+        uint32_t old_size = pool->size;
+        while (pool->used + len + 1 > pool->size)
+            pool->size = pool->size ? pool->size * 2 : INITIAL_DATA_SIZE;
+        pool->data = arena_realloc(pool->arena, pool->data, old_size, pool->size);
+    }
+
+    id = pool->used;
+    memcpy(pool->data + id, name, len + 1);
+    pool->used += len + 1;
+    pool->table[slot] = id;
+    pool->count++;
+    return id;
+}
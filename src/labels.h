@@ -0,0 +1,57 @@
+/*
+   Label pool
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef LABELS_H
+#define LABELS_H
+
+#include <inttypes.h>
+
+#include "arena.h"
+
+/* Range labels repeat a lot, so each distinct label is stored only
+   once in a contiguous byte array. A label is referred to by its
+   32-bit offset in that array. */
+
+#define LABEL_NONE UINT32_MAX
+
+typedef struct label_pool_t {
+    arena_t* arena;
+
+    char* data;
+    uint32_t used, size;
+
+    /* open addressing hash table of label ids, LABEL_NONE if empty */
+    uint32_t* table;
+    uint32_t count, table_size;
+} label_pool_t;
+
+void label_pool_init(label_pool_t* pool, arena_t* arena);
+uint32_t label_intern(label_pool_t* pool, const char* name);
+
+static inline const char*
+label_get(const label_pool_t* pool, uint32_t id)
+{
+    return pool->data + id;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+   Timestamps for the latency statistics
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <unistd.h>
+
+#include "latency.h"
+
+static uint64_t
+raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+double
+latency_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns0, ns1, t0, t1;
+
+    ns0 = raw_ns();
+    t0 = latency_now();
+    usleep(20000);
+    ns1 = raw_ns();
+    t1 = latency_now();
+    if (t1 <= t0)
+        return 1.0;
+    return (double)(ns1 - ns0) / (t1 - t0);
+#else
+    return 1.0;
+#endif
+}
@@ -0,0 +1,117 @@
+/*
+   Asynchronous logging ring
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "logring.h"
+#include "ring.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+
+typedef struct log_record_t {
+    int priority;
+    char msg[LOGRING_MSG_SIZE];
+} log_record_t;
+
+static ring_t ring;
+/* messages pushed while the ring was not running */
+static uint64_t dropped;
+
+static sem_t pending;
+static pthread_t thread;
+static int running = 0, stopping = 0;
+static logring_output_t output_func;
+
+static void*
+logring_loop(void* arg)
+{
+    log_record_t* r;
+
+    for (;;) {
+        while ((r = ring_peek(&ring))) {
+            output_func(r->priority, r->msg);
+            ring_consume(&ring);
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            break;
+        while (sem_wait(&pending) != 0)
+            ;
+    }
+    return NULL;
+}
+
+int
+logring_start(logring_output_t output)
+{
+    if (ring_init(&ring, LOGRING_SIZE, sizeof(log_record_t)) < 0)
+        return -1;
+    output_func = output;
+    stopping = 0;
+    sem_init(&pending, 0, 0);
+    if (pthread_create(&thread, NULL, logring_loop, NULL) != 0) {
+        sem_destroy(&pending);
+        ring_free(&ring);
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+logring_stop(void)
+{
+    if (!running)
+        return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&pending);
+    pthread_join(thread, NULL);
+    sem_destroy(&pending);
+    dropped += ring.dropped;
+    ring_free(&ring);
+}
+
+int
+logring_push(int priority, const char* format, va_list ap)
+{
+    log_record_t* r;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    r = ring_reserve(&ring);
+    if (!r)
+        return -1;
+    r->priority = priority;
+    vsnprintf(r->msg, sizeof(r->msg), format, ap);
+    ring_commit(&ring, r);
+    sem_post(&pending);
+    return 0;
+}
+
+uint64_t
+logring_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED)
+        + (running ? __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED) : 0);
+}
@@ -0,0 +1,47 @@
+/*
+   Asynchronous logging ring
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <inttypes.h>
+#include <stdarg.h>
+
+/* records in the ring, must be a power of 2 */
+#define LOGRING_SIZE 4096
+/* longer messages are truncated */
+#define LOGRING_MSG_SIZE 240
+
+typedef void (*logring_output_t)(int priority, const char* msg);
+
+/* Starts the thread writing the queued messages with output */
+int logring_start(logring_output_t output);
+/* Writes out the remaining messages and stops the thread, once
+   nothing pushes any more messages */
+void logring_stop(void);
+/* Formats a message into the ring, never blocks. Returns -1 and
+   counts the message as dropped if the ring is full or not running. */
+int logring_push(int priority, const char* format, va_list ap);
+uint64_t logring_dropped(void);
+
+#endif
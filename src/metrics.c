@@ -0,0 +1,232 @@
+/*
+   Metrics served on a Unix socket
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/* how long to wait for a request, or for a slow client to read */
+#define METRICS_TIMEOUT_MS 100
+#define METRICS_REQUEST_SIZE 1024
+
+static pthread_t metrics_thread;
+static int running = 0;
+static int listen_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static char* socket_path = NULL;
+static metrics_write_t metrics_write;
+static log_func_t metrics_log;
+
+/* Reads the request, if any, and tells if it is an HTTP one */
+static int
+read_request(int fd)
+{
+    char buf[METRICS_REQUEST_SIZE];
+    size_t len = 0;
+
+    while (len < sizeof(buf) - 1) {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = 0;
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+            break;
+    }
+    return len >= 4 && !memcmp(buf, "GET ", 4);
+}
+
+static void
+write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+serve_client(int fd)
+{
+    struct timeval tv = { 0, METRICS_TIMEOUT_MS * 1000 };
+    char* body = NULL;
+    size_t len = 0;
+    FILE* out;
+    int http;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    http = read_request(fd);
+
+    out = open_memstream(&body, &len);
+    if (!out)
+        return;
+    metrics_write(out);
+    fclose(out);
+
+    if (http) {
+        char header[160];
+        int n = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            len);
+        write_all(fd, header, n);
+    }
+    write_all(fd, body, len);
+    free(body);
+}
+
+static void*
+metrics_loop(void* arg)
+{
+    struct pollfd fds[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = stop_pipe[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        int fd;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            metrics_log(LOG_ERR, "Metrics poll error: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int
+metrics_start(const char* path, metrics_write_t write, log_func_t log)
+{
+    struct sockaddr_un addr;
+
+    metrics_write = write;
+    metrics_log = log;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log(LOG_ERR, "Metrics socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        goto err;
+    // a stale socket of a previous run
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(listen_fd, 8) < 0)
+        goto err;
+    if (pipe(stop_pipe) < 0)
+        goto err;
+    socket_path = strdup(path);
+    if (pthread_create(&metrics_thread, NULL, metrics_loop, NULL) != 0) {
+        errno = EAGAIN;
+        goto err;
+    }
+    running = 1;
+    return 0;
+
+err:
+    log(LOG_ERR, "Cannot listen on metrics socket %s: %s", path, strerror(errno));
+    metrics_stop();
+    return -1;
+}
+
+void
+metrics_stop(void)
+{
+    if (running) {
+        if (write(stop_pipe[1], "q", 1) == 1)
+            pthread_join(metrics_thread, NULL);
+        running = 0;
+    }
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (stop_pipe[0] >= 0) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+    if (socket_path)
+        unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+    listen_fd = stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+void
+metrics_label(FILE* out, const char* value)
+{
+    putc('"', out);
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\')
+            putc('\\', out);
+        if (*value == '\n')
+            fputs("\\n", out);
+        else
+            putc(*value, out);
+    }
+    putc('"', out);
+}
+
+void
+metrics_histogram(FILE* out, const char* name, const char* help,
+    const histogram_t* h)
+{
+    unsigned int bits;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (bits = METRICS_HIST_MIN; bits <= METRICS_HIST_MAX; bits++) {
+        fprintf(out, "%s_bucket{le=\"%.10g\"} %" PRIu64 "\n", name,
+            ((uint64_t)1 << bits) / 1e9, histogram_count_below(h, bits));
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h->count);
+    fprintf(out, "%s_sum %.9f\n", name, h->sum / 1e9);
+    fprintf(out, "%s_count %" PRIu64 "\n", name, h->count);
+}
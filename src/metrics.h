@@ -0,0 +1,53 @@
+/*
+   Metrics served on a Unix socket
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "histogram.h"
+#include "nfblockd.h"
+
+/* the histograms in nanoseconds are exported with the buckets between
+   2^METRICS_HIST_MIN and 2^METRICS_HIST_MAX ns */
+#define METRICS_HIST_MIN 8
+#define METRICS_HIST_MAX 32
+
+/* Writes all the metrics in the Prometheus text format */
+typedef void (*metrics_write_t)(FILE* out);
+
+/* Starts the thread answering the connections to the socket at path
+   with the output of write. HTTP requests get an HTTP response, so a
+   scraper can be connected through a socat bridge, other clients get
+   just the metrics. */
+int metrics_start(const char* path, metrics_write_t write, log_func_t log);
+void metrics_stop(void);
+
+/* Writes a label value with the quotes and backslashes escaped */
+void metrics_label(FILE* out, const char* value);
+/* Writes a histogram of nanoseconds as one in seconds */
+void metrics_histogram(FILE* out, const char* name, const char* help,
+    const histogram_t* h);
+
+#endif
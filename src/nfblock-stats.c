@@ -0,0 +1,208 @@
+/*
+   Reader of the statistics file of nfblockd
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmstats.h"
+
+#define DEFAULT_STATS_FILE "/run/nfblockd/stats"
+/* how long to wait for an update to finish, in milliseconds */
+#define READ_TIMEOUT 1000
+
+static const char* hook_names[SHMSTATS_HOOKS] = { "in", "out", "forward", "other" };
+static const char* verdict_names[SHMSTATS_VERDICTS] = { "drop", "mark", "log", "accept" };
+
+static const shmstats_t*
+map_stats(const char* path, size_t* size)
+{
+    const shmstats_t* m;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(shmstats_t)) {
+        fprintf(stderr, "%s is not a statistics file\n", path);
+        close(fd);
+        return NULL;
+    }
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (m->magic != SHMSTATS_MAGIC || m->version != SHMSTATS_VERSION) {
+        fprintf(stderr, "%s is not a statistics file of version %d\n",
+            path, SHMSTATS_VERSION);
+        munmap((void*)m, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return m;
+}
+
+/* Copies the file while no update is in progress, retrying if one
+   started meanwhile */
+static int
+read_stats(const shmstats_t* m, shmstats_t* copy, size_t size)
+{
+    int i;
+
+    for (i = 0; i < READ_TIMEOUT; i++) {
+        uint64_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            memcpy(copy, m, size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq)
+                return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void
+print_stats(const shmstats_t* s, int ranges)
+{
+    char buf[64];
+    time_t t;
+    unsigned int i;
+    int k;
+
+    t = s->updated;
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("nfblockd %u, updated %s\n", s->pid, buf);
+    t = s->loaded;
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("Blocklist %" PRIu64 " loaded %s in %.1f ms, %u ranges\n",
+        s->generation, buf, s->load_usec / 1000.0, s->range_count);
+    printf("Packets:");
+    for (k = 0; k < SHMSTATS_HOOKS; k++)
+        printf(" %s %" PRIu64, hook_names[k], s->packets[k]);
+    printf("\nVerdicts:");
+    for (k = 0; k < SHMSTATS_VERDICTS; k++)
+        printf(" %s %" PRIu64, verdict_names[k], s->verdicts[k]);
+    printf("\n%" PRIu64 " bad packets, %" PRIu64 " buffer overruns, %" PRIu64
+           " log messages dropped\n",
+        s->errors, s->overruns, s->log_dropped);
+    printf("%" PRIu64 " hits total\n", s->hits);
+
+    if (!ranges)
+        return;
+    for (i = 0; i < s->range_count; i++) {
+        const shmstats_range_t* r = &s->ranges[i];
+        char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
+        uint32_t ip1, ip2;
+
+        if (r->hits == 0)
+            continue;
+        ip1 = htonl(r->ip_min);
+        ip2 = htonl(r->ip_max);
+        inet_ntop(AF_INET, &ip1, buf1, sizeof(buf1));
+        inet_ntop(AF_INET, &ip2, buf2, sizeof(buf2));
+        printf("%s-%s: %" PRIu64 "\n", buf1, buf2, r->hits);
+    }
+}
+
+static void
+print_usage()
+{
+    fprintf(stderr, "Syntax: nfblock-stats [-r] [-i SECONDS] [FILE]\n\n");
+    fprintf(stderr, "        -r            List the hits of each range\n");
+    fprintf(stderr, "        -i SECONDS    Print the statistics repeatedly\n");
+    fprintf(stderr, "        FILE          Statistics file, " DEFAULT_STATS_FILE " by default\n");
+    fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* path = DEFAULT_STATS_FILE;
+    const shmstats_t* m = NULL;
+    shmstats_t* copy = NULL;
+    size_t size = 0;
+    int opt, ranges = 0, interval = 0;
+
+    while ((opt = getopt(argc, argv, "ri:")) != -1) {
+        switch (opt) {
+        case 'r':
+            ranges = 1;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+
+    for (;;) {
+        if (!m) {
+            m = map_stats(path, &size);
+            if (!m)
+                return EXIT_FAILURE;
+            free(copy);
+            copy = malloc(size);
+            if (!copy) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+            }
+        }
+        if (read_stats(m, copy, size) < 0) {
+            fprintf(stderr, "%s is not being updated\n", path);
+            return EXIT_FAILURE;
+        }
+        if (copy->superseded) {
+            // replaced on reload, or removed on exit
+            munmap((void*)m, size);
+            m = NULL;
+            continue;
+        }
+        print_stats(copy, ranges);
+        if (interval <= 0)
+            break;
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+    munmap((void*)m, size);
+    free(copy);
+    return 0;
+}
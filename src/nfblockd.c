@@ -23,6 +23,8 @@
    Boston, MA 02110-1301, USA.
 */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
@@ -30,16 +32,20 @@
 #include <inttypes.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 #include <limits.h>
+#include <linux/netlink.h>
 #include <linux/netfilter_ipv4.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -49,12 +55,30 @@
 
 #ifdef HAVE_DBUS
 #include "dbus.h"
+#include "dbusqueue.h"
 #include <dlfcn.h>
 #endif
 
+#ifdef HAVE_URING
+#include <liburing.h>
+#endif
+
+#ifdef LATENCY_STATS
+#include "latency.h"
+#endif
+
 #include "blocklist.h"
+#include "histogram.h"
+#include "logring.h"
+#include "metrics.h"
 #include "nfblockd.h"
+#include "nfqstat.h"
+#include "packet.h"
 #include "parser.h"
+#include "probes.h"
+#include "shmstats.h"
+#include "sketch.h"
+#include "verdict.h"
 
 #define likely(x) __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
@@ -64,44 +88,212 @@
 
 #define MIN_INTERVAL 60
 
-typedef enum {
-    CMD_NONE,
-    CMD_DUMPSTATS,
-    CMD_RELOAD,
-    CMD_QUIT,
-} command_t;
-
-static blocklist_t blocklist;
+/* Hit counters of one worker, one per blocklist entry. Only the
+   worker owning the array writes to it. */
+typedef struct hit_counter_t {
+    uint64_t hits;
+    time_t lasttime;
+} hit_counter_t;
+
+/* A blocklist together with the statistics collected while in use,
+   replaced as a whole on reload */
+typedef struct generation_t {
+    blocklist_t blocklist;
+    /* an array for each worker */
+    hit_counter_t** counters;
+    int counter_count;
+    /* the last time a hit of each entry was logged */
+    time_t* lastlog;
+    /* number of the load since the start, when and how long it took */
+    uint64_t serial;
+    time_t loaded;
+    uint64_t load_usec;
+} generation_t;
+
+#define CACHE_LINE 64
+
+static generation_t* current;
 
 static int opt_daemon = 0, daemonized = 0;
 static int benchmark = 0;
 static int opt_verbose = 0;
-static int queue_num = 0;
+static int queue_num = 0, queue_last = 0;
+static int pin_workers = 0;
+/* netlink socket and kernel queue sizing, 0 keeps the defaults */
+static unsigned int rcvbuf_size = 0, queue_maxlen = 0;
+static int fail_open = 0, no_enobufs = 0;
+/* parse the packets with packet_parse() instead of libnetfilter_queue */
+static int direct_parse = 0;
+#ifdef HAVE_URING
+static int use_uring = 1;
+#endif
 static int use_syslog = 1;
+static int sort_threads = 1;
 static uint32_t accept_mark = 0, reject_mark = 0;
 static const char* pidfile_name = "/var/run/nfblockd.pid";
+static const char* merge_report_name = NULL;
+static const char* top_report_name = NULL;
+static const char* stats_file_name = NULL;
+static const char* metrics_socket_name = NULL;
 
 static const char* current_charset = 0;
 
 static int blockfile_count = 0;
 static char** blocklist_filenames = 0;
 static const char** blocklist_charsets = 0;
+static int* blocklist_lists = 0;
+
+static int allowfile_count = 0;
+static const char** allowlist_filenames = 0;
+static const char** allowlist_charsets = 0;
+
+/* ordered from the strongest, see resolve_action() */
+typedef enum {
+    ACTION_DROP,
+    ACTION_MARK,
+    ACTION_LOG,
+    ACTION_ACCEPT,
+    /* drop, or place reject_mark if set */
+    ACTION_DEFAULT,
+} list_action_t;
+
+typedef struct list_group_t {
+    const char* name;
+    list_action_t action;
+    uint32_t mark;
+} list_group_t;
+
+/* list 0 holds the files given without a list name */
+static list_group_t lists[MAX_LISTS] = { { "default", ACTION_DEFAULT, 0 } };
+static int list_count = 1;
 
-static volatile command_t command = CMD_NONE;
-static time_t curtime = 0;
 static FILE* pidfile = NULL;
 
+/* netlink messages received by one recvmmsg() call */
+#define RECV_BATCH 64
+#define RECV_BUFSIZE 2048
+/* packets looked up together */
+#define PACKET_BATCH 256
+
+typedef struct worker_t {
+    int index;
+    int queue;
+    int cpu;
+    pthread_t thread;
+    struct nfq_handle* h;
+    struct nfq_q_handle* qh;
+    /* generation used while handling packets, NULL when idle */
+    generation_t* active;
+    time_t curtime;
+    uint64_t list_hits[MAX_LISTS];
+
+    packet_t packets[PACKET_BATCH];
+    unsigned int npackets;
+    verdict_batch_t verdicts;
+
+    /* packets and recvmmsg() calls, see worker_stats() */
+    uint64_t received, recv_calls;
+    /* packets that could not be parsed, receive buffer overruns */
+    uint64_t errors, overruns;
+    time_t overrun_logged;
+    /* times io_uring ran out of provided buffers, see count_exhausted() */
+    uint64_t exhausted;
+    time_t exhausted_logged;
+
+    /* packets per hook and verdicts, see publish_stats() */
+    uint64_t hooks[SHMSTATS_HOOKS];
+    uint64_t actions[SHMSTATS_VERDICTS];
+
+    /* loop iterations over stall_ms and the longest one, see check_stall() */
+    uint64_t stalls, stall_max_ns;
+    time_t stall_logged;
+
+    /* heaviest blocked sources and destinations, see top_stats() */
+    sketch_t top[2];
+    /* nanoseconds taken by the lookups and by the verdicts of a batch */
+    histogram_t lookup_ns, verdict_ns;
+#ifdef LATENCY_STATS
+    /* latency_now() ticks from receiving a packet to its lookup and to
+       its verdict being sent, by hook */
+    histogram_t latency[SHMSTATS_HOOKS][2];
+#endif
+} __attribute__((aligned(CACHE_LINE))) worker_t;
+
+static worker_t* workers = NULL;
+static int worker_count = 0;
+/* written to on exit, wakes up all the workers */
+static int quit_pipe[2] = { -1, -1 };
+
+/* handle used to bind the nf_queue handler for AF_INET */
 struct nfq_handle* nfqueue_h = 0;
-struct nfq_q_handle* nfqueue_qh = 0;
+
+/* whether the messages of this thread go through the log ring */
+static __thread int log_async = 0;
+static int logring_running = 0;
+
+/* statistics dumped in the background, see request_stats() */
+static unsigned int stats_top = 100;
+static pthread_t stats_tid;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER;
+static int stats_running = 0, stats_quit = 0;
+/* snapshot of the hit counters waiting for the thread */
+static uint64_t* stats_hits = NULL;
+/* generation of the snapshot until it is dumped, NULL when idle */
+static generation_t* stats_gen = NULL;
+
+/* worker loop iterations, reloads and statistics dumps taking longer
+   are reported, 0 disables that */
+static unsigned int stall_ms = 100;
+
+/* seconds between the samples of the kernel queue counters */
+#define QUEUE_SAMPLE_INTERVAL 10
+
+/* kernel side of a queue, see sample_queues() */
+typedef struct queue_sample_t {
+    nfqstat_t stat;
+    /* per second since the previous sample */
+    double packets, dropped, user_dropped;
+    /* of the worker at the time of the sample */
+    uint64_t received, stalls;
+} queue_sample_t;
+
+static int sample_kernel = 1;
+static pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+static queue_sample_t* queue_samples = NULL;
+static uint64_t samples_ns = 0;
+
+static void
+log_output(int priority, const char* msg)
+{
+    if (!daemonized)
+        fprintf(stderr, "%s\n", msg);
+    if (opt_daemon)
+        syslog(priority, "%s", msg);
+}
+
+int
+do_log_enabled(int priority)
+{
+    return priority != LOG_DEBUG || opt_verbose >= 1;
+}
 
 void
 do_log(int priority, const char* format, ...)
 {
     va_list ap;
 
-    if (priority == LOG_DEBUG && opt_verbose < 1)
+    if (!do_log_enabled(priority))
         return;
 
+    if (log_async) {
+        // a slow syslog must not stall the packets
+        va_start(ap, format);
+        logring_push(priority, format, ap);
+        va_end(ap);
+        return;
+    }
+
     if (!daemonized) {
         va_start(ap, format);
         vfprintf(stderr, format, ap);
@@ -120,6 +312,8 @@ do_log(int priority, const char* format, ...)
 
 static int use_dbus = 1;
 static void* dbus_lh = NULL;
+/* blocked signals sent per second at most */
+static unsigned int dbus_rate = 20;
 
 static nfblock_dbus_init_t nfblock_dbus_init = NULL;
 static nfblock_dbus_send_blocked_t nfblock_dbus_send_blocked = NULL;
@@ -172,23 +366,131 @@ close_dbus()
 
 #endif
 
+static inline uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static int
-load_all_lists()
+load_all_lists(blocklist_t* bl)
 {
     int i, ret = 0;
+    uint64_t estimate = 0;
+    FILE* report = NULL;
 
-    blocklist_clear(&blocklist, 0);
+    blocklist_clear(bl, 0);
+    for (i = 0; i < blockfile_count; i++)
+        estimate += estimate_list(blocklist_filenames[i]);
+    blocklist_reserve(bl, estimate > UINT_MAX / 2 ? UINT_MAX / 2 : estimate);
     for (i = 0; i < blockfile_count; i++) {
-        if (load_list(&blocklist, blocklist_filenames[i], blocklist_charsets[i])) {
+#ifndef LOWMEM
+        bl->list = blocklist_lists[i];
+#endif
+        if (load_list(bl, blocklist_filenames[i], blocklist_charsets[i])) {
             do_log(LOG_ERR, "Error loading %s", blocklist_filenames[i]);
             ret = -1;
         }
     }
-    blocklist_sort(&blocklist);
-    blocklist_trim(&blocklist);
+    blocklist_sort(bl, sort_threads);
+
+    if (merge_report_name) {
+        report = fopen(merge_report_name, "w");
+        if (!report)
+            do_log(LOG_ERR, "Cannot open merge report %s: %s",
+                merge_report_name, strerror(errno));
+    }
+    blocklist_trim(bl, report);
+    if (report)
+        fclose(report);
+
+    if (allowfile_count > 0) {
+        blocklist_t allowlist;
+        unsigned int count = bl->count;
+
+        blocklist_init(&allowlist);
+        for (i = 0; i < allowfile_count; i++) {
+            if (load_list(&allowlist, allowlist_filenames[i], allowlist_charsets[i])) {
+                do_log(LOG_ERR, "Error loading %s", allowlist_filenames[i]);
+                ret = -1;
+            }
+        }
+        blocklist_sort(&allowlist, 1);
+        blocklist_trim(&allowlist, NULL);
+        blocklist_subtract(bl, &allowlist);
+        do_log(LOG_DEBUG, "Allowlists: %u ranges, blocklist %u -> %u ranges",
+            allowlist.count, count, bl->count);
+        blocklist_clear(&allowlist, 0);
+    }
+    return ret;
+}
+
+static void*
+alloc_aligned(size_t size)
+{
+    void* ptr;
+
+    size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    if (posix_memalign(&ptr, CACHE_LINE, size ? size : CACHE_LINE) != 0)
+        return NULL;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/* Loads the blocklists into a new generation with zeroed counters */
+static int
+generation_load(generation_t** out)
+{
+    static uint64_t serial = 0;
+    generation_t* gen;
+    struct timespec start, end;
+    unsigned int count;
+    int i, ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    gen = malloc(sizeof(generation_t));
+    CHECK_OOM(gen);
+    blocklist_init(&gen->blocklist);
+    ret = load_all_lists(&gen->blocklist);
+    count = gen->blocklist.count;
+
+    // the arrays are aligned, so no two workers share a cache line
+    gen->counter_count = worker_count;
+    gen->counters = malloc(sizeof(hit_counter_t*) * (worker_count ? worker_count : 1));
+    CHECK_OOM(gen->counters);
+    for (i = 0; i < worker_count; i++) {
+        gen->counters[i] = alloc_aligned(sizeof(hit_counter_t) * count);
+        CHECK_OOM(gen->counters[i]);
+    }
+    gen->lastlog = alloc_aligned(sizeof(time_t) * count);
+    CHECK_OOM(gen->lastlog);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    gen->serial = ++serial;
+    gen->loaded = time(NULL);
+    gen->load_usec = (end.tv_sec - start.tv_sec) * 1000000ull
+        + end.tv_nsec / 1000 - start.tv_nsec / 1000;
+
+    *out = gen;
     return ret;
 }
 
+static void
+generation_free(generation_t* gen)
+{
+    int i;
+
+    blocklist_clear(&gen->blocklist, 0);
+    for (i = 0; i < gen->counter_count; i++)
+        free(gen->counters[i]);
+    free(gen->counters);
+    free(gen->lastlog);
+    free(gen);
+}
+
 static void
 check_set_verdict_status(int status)
 {
@@ -197,167 +499,565 @@ check_set_verdict_status(int status)
     }
 }
 
-#define MAX_RANGES 16
-static int
-nfqueue_cb(struct nfq_q_handle* qh, struct nfgenmsg* nfmsg,
-    struct nfq_data* nfa, void* data)
+static void
+list_stats()
 {
-    int id = 0, status = 0;
-    struct nfqnl_msg_packet_hdr* ph;
-    unsigned char* payload;
-    block_entry2_t *src, *dst;
-    uint32_t ip_src, ip_dst;
-    char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
-#ifndef LOWMEM
-    const char *sranges[MAX_RANGES + 1], *dranges[MAX_RANGES + 1];
-#else
-    /* dummy variables */
-    static void *sranges = 0, *dranges = 0;
+    int i, j;
+
+    if (list_count < 2)
+        return;
+    for (i = 0; i < list_count; i++) {
+        uint64_t hits = 0;
+        for (j = 0; j < worker_count; j++)
+            hits += __atomic_load_n(&workers[j].list_hits[i], __ATOMIC_RELAXED);
+        do_log(LOG_INFO, "List %s: %" PRIu64 " hits", lists[i].name, hits);
+    }
+}
+
+static void
+worker_stats()
+{
+    int i;
+
+    for (i = 0; i < worker_count; i++) {
+        worker_t* w = &workers[i];
+        uint64_t packets = __atomic_load_n(&w->received, __ATOMIC_RELAXED);
+        uint64_t recvs = __atomic_load_n(&w->recv_calls, __ATOMIC_RELAXED);
+        uint64_t sends = __atomic_load_n(&w->verdicts.syscalls, __ATOMIC_RELAXED);
+        do_log(LOG_INFO, "Queue %d: %" PRIu64 " packets, %" PRIu64 " receive and %"
+            PRIu64 " verdict syscalls (%.2f per packet)", w->queue, packets, recvs, sends,
+            packets ? (double)(recvs + sends) / packets : 0.0);
+        do_log(LOG_INFO, "Queue %d: %" PRIu64 " buffer overruns, %" PRIu64 " bad packets",
+            w->queue, __atomic_load_n(&w->overruns, __ATOMIC_RELAXED),
+            __atomic_load_n(&w->errors, __ATOMIC_RELAXED));
+#ifdef HAVE_URING
+        if (use_uring)
+            do_log(LOG_INFO, "Queue %d: ran out of io_uring receive buffers %" PRIu64 " times",
+                w->queue, __atomic_load_n(&w->exhausted, __ATOMIC_RELAXED));
 #endif
+        do_log(LOG_INFO, "Queue %d: %" PRIu64 " loop stalls over %u ms, longest %.1f ms",
+            w->queue, __atomic_load_n(&w->stalls, __ATOMIC_RELAXED), stall_ms,
+            __atomic_load_n(&w->stall_max_ns, __ATOMIC_RELAXED) / 1e6);
+    }
+    do_log(LOG_INFO, "%" PRIu64 " log messages dropped", logring_dropped());
+#ifdef HAVE_DBUS
+    if (use_dbus)
+        dbusq_stats(do_log);
+#endif
+}
 
-    ph = nfq_get_msg_packet_hdr(nfa);
-    if (unlikely(!ph)) {
-        do_log(LOG_ERR, "NFQUEUE: can't get msg packet header.");
-        // from nfqueue source: 0 = ok, >0 = soft error, <0 hard error
-        return 1;
+/* Logs the last sample of the kernel queue counters */
+static void
+queue_stats()
+{
+    int i;
+
+    if (!queue_samples)
+        return;
+    pthread_mutex_lock(&samples_lock);
+    for (i = 0; i < worker_count; i++) {
+        queue_sample_t* q = &queue_samples[i];
+
+        if (!q->stat.valid)
+            continue;
+        do_log(LOG_INFO, "Queue %d kernel: %u waiting, %u dropped, %u not delivered, "
+            "id %u; %.1f packets/s, %.1f dropped/s, %.1f not delivered/s",
+            workers[i].queue, q->stat.queue_total, q->stat.queue_dropped,
+            q->stat.user_dropped, q->stat.id_sequence, q->packets, q->dropped,
+            q->user_dropped);
     }
+    pthread_mutex_unlock(&samples_lock);
+}
 
-    id = ntohl(ph->packet_id);
-    status = nfq_get_payload(nfa, &payload);
-    if (unlikely(status < 0)) {
-        do_log(LOG_ERR, "NFQUEUE: can't get packet payload.");
-        return 1;
-    } else if (unlikely(status < (int)sizeof(struct iphdr))) {
-        do_log(LOG_ERR, "NFQUEUE: packet payload too short.");
-        return 1;
+/* Reads the kernel counters of the queues and reports the drops since
+   the previous sample, together with the stalls of the worker, and
+   the workers handling nothing while packets are waiting */
+static void
+sample_queues()
+{
+    nfqstat_t* stat;
+    uint64_t now = now_ns();
+    double secs = (now - samples_ns) / 1e9;
+    int i;
+
+    stat = malloc(sizeof(nfqstat_t) * worker_count);
+    CHECK_OOM(stat);
+    if (nfqstat_read(NFQSTAT_PATH, queue_num, worker_count, stat) < 0) {
+        do_log(LOG_INFO, "Cannot read %s: %s, not sampling the kernel queues",
+            NFQSTAT_PATH, strerror(errno));
+        sample_kernel = 0;
+        free(stat);
+        return;
+    }
+    pthread_mutex_lock(&samples_lock);
+    for (i = 0; i < worker_count; i++) {
+        queue_sample_t* q = &queue_samples[i];
+        worker_t* w = &workers[i];
+        uint64_t received = __atomic_load_n(&w->received, __ATOMIC_RELAXED);
+        uint64_t stalls = __atomic_load_n(&w->stalls, __ATOMIC_RELAXED);
+
+        if (!stat[i].valid)
+            continue;
+        if (q->stat.valid) {
+            uint32_t dropped = stat[i].queue_dropped - q->stat.queue_dropped;
+            uint32_t user_dropped = stat[i].user_dropped - q->stat.user_dropped;
+
+            q->packets = (uint32_t)(stat[i].id_sequence - q->stat.id_sequence) / secs;
+            q->dropped = dropped / secs;
+            q->user_dropped = user_dropped / secs;
+            if (dropped || user_dropped)
+                do_log(LOG_WARNING, "Queue %d: %u packets dropped by the kernel (%.1f/s), "
+                    "%u not delivered (%.1f/s), %" PRIu64 " loop stalls meanwhile",
+                    w->queue, dropped, q->dropped, user_dropped, q->user_dropped,
+                    stalls - q->stalls);
+            if (stat[i].queue_total && q->stat.queue_total && received == q->received)
+                do_log(LOG_WARNING, "Queue %d: no packets received for %.0f s, "
+                    "%u waiting", w->queue, secs, stat[i].queue_total);
+        }
+        q->stat = stat[i];
+        q->received = received;
+        q->stalls = stalls;
+    }
+    samples_ns = now;
+    pthread_mutex_unlock(&samples_lock);
+    free(stat);
+}
+
+#define TOP_SRC 0
+#define TOP_DST 1
+
+/* Logs the heaviest blocked addresses of all the workers, and writes
+   them to the top report if given */
+static void
+top_stats()
+{
+    static const char* const names[2] = { "source", "destination" };
+    sketch_t** sketches;
+    sketch_result_t top[SKETCH_TOP];
+    FILE* report = NULL;
+    unsigned int i, n;
+    int dir;
+
+    sketches = malloc(sizeof(sketch_t*) * (worker_count ? worker_count : 1));
+    CHECK_OOM(sketches);
+    if (top_report_name) {
+        report = fopen(top_report_name, "w");
+        if (!report)
+            do_log(LOG_ERR, "Cannot open top report %s: %s",
+                top_report_name, strerror(errno));
+    }
+    for (dir = TOP_SRC; dir <= TOP_DST; dir++) {
+        for (i = 0; i < (unsigned int)worker_count; i++)
+            sketches[i] = &workers[i].top[dir];
+        n = sketch_top(sketches, worker_count, top, SKETCH_TOP);
+        for (i = 0; i < n; i++) {
+            char buf[INET_ADDRSTRLEN];
+
+            inet_ntop(AF_INET, &top[i].addr, buf, sizeof(buf));
+            do_log(LOG_INFO, "Top %s %s: ~%" PRIu64 " hits", names[dir], buf, top[i].count);
+            if (report)
+                fprintf(report, "%s\t%s\t%" PRIu64 "\n", names[dir], buf, top[i].count);
+        }
+    }
+    if (report)
+        fclose(report);
+    free(sketches);
+}
+
+/* Sums up the counters of all the workers */
+static uint64_t*
+generation_snapshot(generation_t* gen)
+{
+    unsigned int i, count = gen->blocklist.count;
+    uint64_t* hits;
+    int k;
+
+    hits = (uint64_t*)calloc(count ? count : 1, sizeof(uint64_t));
+    CHECK_OOM(hits);
+    for (k = 0; k < gen->counter_count; k++) {
+        hit_counter_t* c = gen->counters[k];
+        for (i = 0; i < count; i++)
+            hits[i] += __atomic_load_n(&c[i].hits, __ATOMIC_RELAXED);
+    }
+    return hits;
+}
+
+#ifdef LATENCY_STATS
+/* nanoseconds per latency_now() tick */
+static double ns_per_tick = 1.0;
+
+/* Logs the percentiles of the packet latencies of all the workers */
+static void
+latency_stats()
+{
+    static const char* const names[SHMSTATS_HOOKS] = { "IN", "OUT", "FWD", "other" };
+    static const double fractions[] = { 0.5, 0.99, 0.999, 1.0 };
+    histogram_t* h;
+    int hook, i, k;
+
+    h = malloc(sizeof(histogram_t) * 2);
+    CHECK_OOM(h);
+    for (hook = 0; hook < SHMSTATS_HOOKS; hook++) {
+        double us[2][4];
+
+        memset(h, 0, sizeof(histogram_t) * 2);
+        for (i = 0; i < worker_count; i++) {
+            histogram_merge(&h[0], &workers[i].latency[hook][0]);
+            histogram_merge(&h[1], &workers[i].latency[hook][1]);
+        }
+        if (h[1].count == 0)
+            continue;
+        for (k = 0; k < 4; k++) {
+            us[0][k] = histogram_percentile(&h[0], fractions[k]) * ns_per_tick / 1000;
+            us[1][k] = histogram_percentile(&h[1], fractions[k]) * ns_per_tick / 1000;
+        }
+        do_log(LOG_INFO, "Latency %s: %" PRIu64 " packets, lookup p50/p99/p99.9/max "
+            "%.1f/%.1f/%.1f/%.1f us, verdict %.1f/%.1f/%.1f/%.1f us", names[hook],
+            h[1].count, us[0][0], us[0][1], us[0][2], us[0][3],
+            us[1][0], us[1][1], us[1][2], us[1][3]);
+    }
+    free(h);
+}
+#endif
+
+/* Logs all the statistics, given a snapshot of the counters of gen */
+static void
+dump_stats(generation_t* gen, uint64_t* hits)
+{
+    uint64_t start = now_ns(), took;
+
+    blocklist_stats(&gen->blocklist, hits, stats_top);
+    free(hits);
+    list_stats();
+    top_stats();
+    worker_stats();
+    queue_stats();
+#ifdef LATENCY_STATS
+    latency_stats();
+#endif
+    took = now_ns() - start;
+    if (stall_ms && took > stall_ms * 1000000ull)
+        do_log(LOG_WARNING, "Dumping the statistics took %.1f ms", took / 1e6);
+}
+
+/* Dumps the snapshots handed over by request_stats() */
+static void*
+stats_thread(void* arg)
+{
+    pthread_mutex_lock(&stats_lock);
+    for (;;) {
+        generation_t* gen;
+        uint64_t* hits;
+
+        while (!stats_hits && !stats_quit)
+            pthread_cond_wait(&stats_cond, &stats_lock);
+        if (!stats_hits)
+            break;
+        gen = __atomic_load_n(&stats_gen, __ATOMIC_SEQ_CST);
+        hits = stats_hits;
+        pthread_mutex_unlock(&stats_lock);
+
+        dump_stats(gen, hits);
+
+        pthread_mutex_lock(&stats_lock);
+        stats_hits = NULL;
+        __atomic_store_n(&stats_gen, NULL, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return NULL;
+}
+
+static int
+stats_start()
+{
+    stats_quit = 0;
+    if (pthread_create(&stats_tid, NULL, stats_thread, NULL) != 0)
+        return -1;
+    stats_running = 1;
+    return 0;
+}
+
+/* Finishes the pending dump and stops the thread */
+static void
+stats_stop()
+{
+    if (!stats_running)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    stats_quit = 1;
+    pthread_cond_signal(&stats_cond);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_join(stats_tid, NULL);
+    stats_running = 0;
+}
+
+/* Takes a snapshot of the counters and lets the stats thread sort and
+   log it, so that neither the workers nor the signal handling wait for
+   a slow syslog. A request coming while the previous one is still
+   being dumped is dropped. */
+static void
+request_stats()
+{
+    generation_t* gen = current;
+
+    if (!stats_running) {
+        dump_stats(gen, generation_snapshot(gen));
+        return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    if (__atomic_load_n(&stats_gen, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_unlock(&stats_lock);
+        do_log(LOG_INFO, "Statistics are still being dumped, request ignored");
+        return;
+    }
+    // keeps the generation, see reload_lists()
+    __atomic_store_n(&stats_gen, gen, __ATOMIC_SEQ_CST);
+    stats_hits = generation_snapshot(gen);
+    pthread_cond_signal(&stats_cond);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static uint64_t
+entry_hits(generation_t* gen, unsigned int idx)
+{
+    uint64_t hits = 0;
+    int k;
+
+    for (k = 0; k < gen->counter_count; k++)
+        hits += __atomic_load_n(&gen->counters[k][idx].hits, __ATOMIC_RELAXED);
+    return hits;
+}
+
+/* Counts a hit of an entry and tells if it should be logged. That is
+   when the worker did not see the entry for MIN_INTERVAL, and no other
+   worker logged it meanwhile. The shared lastlog is only touched in
+   the first case, so the hot entries stay in the worker's cache. */
+static int
+count_hit(worker_t* w, generation_t* gen, block_entry2_t* e2)
+{
+    unsigned int idx = e2 - gen->blocklist.entries2;
+    hit_counter_t* c = &gen->counters[w->index][idx];
+    time_t curtime = w->curtime, lasttime = c->lasttime;
+
+    // the only writer, a plain store is enough for the readers
+    __atomic_store_n(&c->hits, c->hits + 1, __ATOMIC_RELAXED);
+    c->lasttime = curtime;
+    if (lasttime >= curtime - MIN_INTERVAL)
+        return 0;
+    lasttime = __atomic_exchange_n(&gen->lastlog[idx], curtime, __ATOMIC_RELAXED);
+    return lasttime < curtime - MIN_INTERVAL;
+}
+
+/* Picks the strongest action of the lists in the mask */
+static list_action_t
+resolve_action(worker_t* w, uint32_t mask, int hook, uint32_t* mark)
+{
+    list_action_t ret = ACTION_LOG;
+    int i;
+
+    for (i = 0; i < list_count; i++) {
+        list_action_t action;
+        uint32_t m;
+
+        if (!(mask & (1u << i)))
+            continue;
+        action = lists[i].action;
+        m = lists[i].mark;
+        if (action == ACTION_DEFAULT) {
+            // incoming packets are dropped instead of being rejected,
+            // we don't want the other host to know we are alive
+            if (hook == NF_IP_LOCAL_IN || !reject_mark) {
+                action = ACTION_DROP;
+            } else {
+                action = ACTION_MARK;
+                m = reject_mark;
+            }
+        }
+        if (action < ret) {
+            ret = action;
+            *mark = m;
+        }
+        __atomic_store_n(&w->list_hits[i], w->list_hits[i] + 1, __ATOMIC_RELAXED);
     }
+    return ret;
+}
 
-    switch (ph->hook) {
+static void
+set_verdict(worker_t* w, uint32_t id, list_action_t action, uint32_t mark)
+{
+    int status;
+
+    __atomic_store_n(&w->actions[action], w->actions[action] + 1, __ATOMIC_RELAXED);
+    PROBE3(verdict, w->queue, id, action);
+    switch (action) {
+    case ACTION_DROP:
+        status = verdict_set(&w->verdicts, id, NF_DROP, 0, 0);
+        break;
+    case ACTION_MARK:
+        // we set the list mark and set NF_REPEAT verdict
+        // it's up to other iptables rules to decide what to do with this marked packet
+        status = verdict_set(&w->verdicts, id, NF_REPEAT, 1, mark);
+        break;
+    default:
+        // NF_ACCEPT, or NF_REPEAT with the user-defined accept_mark,
+        // for all the accepted packets at once
+        verdict_accept(&w->verdicts, id);
+        status = 0;
+        break;
+    }
+    check_set_verdict_status(status);
+}
+
+static int
+hook_index(int hook)
+{
+    switch (hook) {
+    case NF_IP_LOCAL_IN:
+        return SHMSTATS_IN;
+    case NF_IP_LOCAL_OUT:
+        return SHMSTATS_OUT;
+    case NF_IP_FORWARD:
+        return SHMSTATS_FWD;
+    default:
+        return SHMSTATS_OTHER;
+    }
+}
+
+static void
+count_packet(worker_t* w, int hook)
+{
+    int i = hook_index(hook);
+
+    __atomic_store_n(&w->hooks[i], w->hooks[i] + 1, __ATOMIC_RELAXED);
+}
+
+#define ACTION_NAME(action) ((action) == ACTION_LOG ? "Logged" : "Blocked")
+
+#define MAX_RANGES 16
+#ifndef LOWMEM
+#define FIRST_RANGE(ranges) ((ranges)[0])
+#else
+/* the names are not kept */
+#define FIRST_RANGE(ranges) ""
+#endif
+/* Decides a packet, given the results of the lookups */
+static void
+handle_packet(worker_t* w, generation_t* gen, packet_t* p,
+    block_entry2_t* src, block_entry2_t* dst)
+{
+    blocklist_t* bl = &gen->blocklist;
+    uint32_t id = p->id;
+    int log;
+    uint64_t shits = 0, dhits = 0;
+    uint32_t mark = 0;
+    list_action_t action;
+    char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
+#ifndef LOWMEM
+    const char *sranges[MAX_RANGES + 1], *dranges[MAX_RANGES + 1];
+#endif
+
+    count_packet(w, p->hook);
+    PROBE4(lookup, p->saddr, p->daddr, src != NULL, dst != NULL);
+    switch (p->hook) {
     case NF_IP_LOCAL_IN:
-        ip_src = ntohl(SRC_ADDR(payload));
-        src = blocklist_find(&blocklist, ip_src, sranges, MAX_RANGES);
         if (src) {
-            // we drop the packet instead of rejecting
-            // we don't want the other host to know we are alive
-            status = nfq_set_verdict(qh, id, NF_DROP, 0, NULL);
-            check_set_verdict_status(status);
-            src->hits++;
-            if (src->lasttime < curtime - MIN_INTERVAL) {
-                inet_ntop(AF_INET, &SRC_ADDR(payload), buf1, sizeof(buf1));
+            action = resolve_action(w, src->lists, p->hook, &mark);
+            set_verdict(w, id, action, mark);
+            sketch_add(&w->top[TOP_SRC], p->saddr);
+            if (count_hit(w, gen, src)) {
+#ifndef LOWMEM
+                // the names are only needed for logging
+                blocklist_names(bl, src, ntohl(p->saddr), sranges, MAX_RANGES);
+#endif
+                shits = entry_hits(gen, src - bl->entries2);
+                inet_ntop(AF_INET, &p->saddr, buf1, sizeof(buf1));
 #ifdef HAVE_DBUS
-                if (use_dbus) {
-                    nfblock_dbus_send_blocked(do_log, curtime, LOG_NF_IN,
-                        reject_mark ? false : true,
-                        buf1, sranges, src->hits);
-                }
+                if (use_dbus)
+                    dbusq_push(w->curtime, LOG_NF_IN, action == ACTION_DROP,
+                        buf1, FIRST_RANGE(sranges), shits);
 #endif
                 if (use_syslog) {
 #ifndef LOWMEM
-                    do_log(LOG_NOTICE, "Blocked IN: %s, hits: %d, SRC: %s",
-                        sranges[0], src->hits, buf1);
+                    do_log(LOG_NOTICE, "%s IN: %s, hits: %" PRIu64 ", SRC: %s",
+                        ACTION_NAME(action), sranges[0], shits, buf1);
 #else
-                    do_log(LOG_NOTICE, "Blocked IN: hits: %d, SRC: %s",
-                        src->hits, buf1);
+                    do_log(LOG_NOTICE, "%s IN: hits: %" PRIu64 ", SRC: %s",
+                        ACTION_NAME(action), shits, buf1);
 #endif
                 }
             }
-            src->lasttime = curtime;
-        } else if (unlikely(accept_mark)) {
-            // we set the user-defined accept_mark and set NF_REPEAT verdict
-            // it's up to other iptables rules to decide what to do with this marked packet
-            status = nfq_set_verdict2(qh, id, NF_REPEAT, accept_mark, 0, NULL);
-            check_set_verdict_status(status);
         } else {
-            // no accept_mark, just NF_ACCEPT the packet
-            status = nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
-            check_set_verdict_status(status);
+            set_verdict(w, id, ACTION_ACCEPT, 0);
         }
         break;
     case NF_IP_LOCAL_OUT:
-        ip_dst = ntohl(DST_ADDR(payload));
-        dst = blocklist_find(&blocklist, ip_dst, dranges, MAX_RANGES);
         if (dst) {
-            if (likely(reject_mark)) {
-                // we set the user-defined reject_mark and set NF_REPEAT verdict
-                // it's up to other iptables rules to decide what to do with this marked packet
-                status = nfq_set_verdict2(qh, id, NF_REPEAT, reject_mark, 0, NULL);
-                check_set_verdict_status(status);
-            } else {
-                status = nfq_set_verdict(qh, id, NF_DROP, 0, NULL);
-                check_set_verdict_status(status);
-            }
-            dst->hits++;
-            if (dst->lasttime < curtime - MIN_INTERVAL) {
-                inet_ntop(AF_INET, &DST_ADDR(payload), buf1, sizeof(buf1));
+            action = resolve_action(w, dst->lists, p->hook, &mark);
+            set_verdict(w, id, action, mark);
+            sketch_add(&w->top[TOP_DST], p->daddr);
+            if (count_hit(w, gen, dst)) {
+#ifndef LOWMEM
+                blocklist_names(bl, dst, ntohl(p->daddr), dranges, MAX_RANGES);
+#endif
+                dhits = entry_hits(gen, dst - bl->entries2);
+                inet_ntop(AF_INET, &p->daddr, buf1, sizeof(buf1));
 #ifdef HAVE_DBUS
-                if (use_dbus) {
-                    nfblock_dbus_send_blocked(do_log, curtime, LOG_NF_OUT,
-                        reject_mark ? false : true,
-                        buf1, dranges, dst->hits);
-                }
+                if (use_dbus)
+                    dbusq_push(w->curtime, LOG_NF_OUT, action == ACTION_DROP,
+                        buf1, FIRST_RANGE(dranges), dhits);
 #endif
                 if (use_syslog) {
 #ifndef LOWMEM
-                    do_log(LOG_NOTICE, "Blocked OUT: %s, hits: %d, DST: %s",
-                        dranges[0], dst->hits, buf1);
+                    do_log(LOG_NOTICE, "%s OUT: %s, hits: %" PRIu64 ", DST: %s",
+                        ACTION_NAME(action), dranges[0], dhits, buf1);
 #else
-                    do_log(LOG_NOTICE, "Blocked OUT: %s, hits: %d, DST: %s",
-                        dst->hits, buf1);
+                    do_log(LOG_NOTICE, "%s OUT: hits: %" PRIu64 ", DST: %s",
+                        ACTION_NAME(action), dhits, buf1);
 #endif
                 }
             }
-            dst->lasttime = curtime;
-        } else if (unlikely(accept_mark)) {
-            // we set the user-defined accept_mark and set NF_REPEAT verdict
-            // it's up to other iptables rules to decide what to do with this marked packet
-            status = nfq_set_verdict2(qh, id, NF_REPEAT, accept_mark, 0, NULL);
-            check_set_verdict_status(status);
         } else {
-            // no accept_mark, just NF_ACCEPT the packet
-            status = nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
-            check_set_verdict_status(status);
+            set_verdict(w, id, ACTION_ACCEPT, 0);
         }
         break;
     case NF_IP_FORWARD:
-        ip_src = ntohl(SRC_ADDR(payload));
-        ip_dst = ntohl(DST_ADDR(payload));
-        src = blocklist_find(&blocklist, ip_src, sranges, MAX_RANGES);
-        dst = blocklist_find(&blocklist, ip_dst, dranges, MAX_RANGES);
         if (dst || src) {
-            int lasttime = 0;
-            if (likely(reject_mark)) {
-                // we set the user-defined reject_mark and set NF_REPEAT verdict
-                // it's up to other iptables rules to decide what to do with this marked packet
-                status = nfq_set_verdict2(qh, id, NF_REPEAT, reject_mark, 0, NULL);
-                check_set_verdict_status(status);
-            } else {
-                status = nfq_set_verdict(qh, id, NF_DROP, 0, NULL);
-                check_set_verdict_status(status);
-            }
+            log = 1;
+            action = resolve_action(w, (src ? src->lists : 0) | (dst ? dst->lists : 0),
+                p->hook, &mark);
+            set_verdict(w, id, action, mark);
             if (src) {
-                src->hits++;
-                lasttime = src->lasttime;
-                src->lasttime = curtime;
+                sketch_add(&w->top[TOP_SRC], p->saddr);
+                log &= count_hit(w, gen, src);
             }
             if (dst) {
-                dst->hits++;
-                if (dst->lasttime > lasttime)
-                    lasttime = dst->lasttime;
-                dst->lasttime = curtime;
+                sketch_add(&w->top[TOP_DST], p->daddr);
+                log &= count_hit(w, gen, dst);
             }
-            if (lasttime < curtime - MIN_INTERVAL) {
-                inet_ntop(AF_INET, &SRC_ADDR(payload), buf1, sizeof(buf1));
-                inet_ntop(AF_INET, &DST_ADDR(payload), buf2, sizeof(buf2));
+            if (log) {
+                if (src) {
+#ifndef LOWMEM
+                    blocklist_names(bl, src, ntohl(p->saddr), sranges, MAX_RANGES);
+#endif
+                    shits = entry_hits(gen, src - bl->entries2);
+                }
+                if (dst) {
+#ifndef LOWMEM
+                    blocklist_names(bl, dst, ntohl(p->daddr), dranges, MAX_RANGES);
+#endif
+                    dhits = entry_hits(gen, dst - bl->entries2);
+                }
+                inet_ntop(AF_INET, &p->saddr, buf1, sizeof(buf1));
+                inet_ntop(AF_INET, &p->daddr, buf2, sizeof(buf2));
 #ifdef HAVE_DBUS
                 if (use_dbus) {
                     if (src) {
-                        nfblock_dbus_send_blocked(do_log, curtime, LOG_NF_IN,
-                            reject_mark ? false : true,
-                            buf1, sranges, src->hits);
+                        dbusq_push(w->curtime, LOG_NF_IN, action == ACTION_DROP,
+                            buf1, FIRST_RANGE(sranges), shits);
                     }
                     if (dst) {
-                        nfblock_dbus_send_blocked(do_log, curtime, LOG_NF_OUT, reject_mark ? false : true,
-                            buf2, dranges, dst->hits);
+                        dbusq_push(w->curtime, LOG_NF_OUT, action == ACTION_DROP,
+                            buf2, FIRST_RANGE(dranges), dhits);
                     }
                     /*
   nfblock_dbus_send_signal_nfq(do_log, curtime, LOG_NF_FWD, reject_mark ? NFBP_ACTION_MARK : NFBP_ACTION_DROP,
@@ -368,175 +1068,1049 @@ nfqueue_cb(struct nfq_q_handle* qh, struct nfgenmsg* nfmsg,
                 }
 #endif
                 if (use_syslog) {
+#ifndef LOWMEM
+                    do_log(LOG_NOTICE, "%s FWD: %s->%s, hits: %" PRIu64 ",%" PRIu64 ", SRC: %s, DST: %s",
+                        ACTION_NAME(action),
+                        src ? sranges[0] : "(unknown)", dst ? dranges[0] : "(unknown)",
+                        shits, dhits, buf1, buf2);
+#else
+                    do_log(LOG_NOTICE, "%s FWD: hits: %" PRIu64 ",%" PRIu64 ", SRC: %s, DST: %s",
+                        ACTION_NAME(action),
+                        shits, dhits, buf1, buf2);
+#endif
+                }
+            }
+        } else {
+            set_verdict(w, id, ACTION_ACCEPT, 0);
+        }
+        break;
+    default:
+        // the batch verdict would accept it anyway
+        do_log(LOG_NOTICE, "Not NF_LOCAL_IN/OUT/FORWARD packet!");
+        set_verdict(w, id, ACTION_ACCEPT, 0);
+        break;
+    }
+}
+
+/* Looks up the addresses of all the collected packets at once and
+   sends the verdicts */
+static void
+process_batch(worker_t* w)
+{
+    generation_t* gen = w->active;
+    uint32_t ips[PACKET_BATCH * 2];
+    block_entry2_t* found[PACKET_BATCH * 2];
+    unsigned int i, n = 0;
+    uint64_t start, looked_up;
+#ifdef LATENCY_STATS
+    uint64_t lookup_stamp, sent_stamp;
+#endif
+
+    if (w->npackets == 0) {
+        check_set_verdict_status(verdict_flush(&w->verdicts));
+        return;
+    }
+    start = now_ns();
+    PROBE2(batch_start, w->queue, w->npackets);
+    for (i = 0; i < w->npackets; i++) {
+        packet_t* p = &w->packets[i];
+        if (p->hook == NF_IP_LOCAL_IN || p->hook == NF_IP_FORWARD)
+            ips[n++] = ntohl(p->saddr);
+        if (p->hook == NF_IP_LOCAL_OUT || p->hook == NF_IP_FORWARD)
+            ips[n++] = ntohl(p->daddr);
+    }
+    blocklist_find_batch(&gen->blocklist, ips, n, found);
+#ifdef LATENCY_STATS
+    lookup_stamp = latency_now();
+#endif
+    looked_up = now_ns();
+    histogram_add(&w->lookup_ns, looked_up - start);
+
+    for (i = 0, n = 0; i < w->npackets; i++) {
+        packet_t* p = &w->packets[i];
+        block_entry2_t *src = NULL, *dst = NULL;
+        if (p->hook == NF_IP_LOCAL_IN || p->hook == NF_IP_FORWARD)
+            src = found[n++];
+        if (p->hook == NF_IP_LOCAL_OUT || p->hook == NF_IP_FORWARD)
+            dst = found[n++];
+        handle_packet(w, gen, p, src, dst);
+    }
+
+    check_set_verdict_status(verdict_flush(&w->verdicts));
+    histogram_add(&w->verdict_ns, now_ns() - looked_up);
+#ifdef LATENCY_STATS
+    sent_stamp = latency_now();
+    for (i = 0; i < w->npackets; i++) {
+        packet_t* p = &w->packets[i];
+        histogram_t* h = w->latency[hook_index(p->hook)];
+        histogram_add(&h[0], lookup_stamp - p->stamp);
+        histogram_add(&h[1], sent_stamp - p->stamp);
+    }
+#endif
+    PROBE2(batch_done, w->queue, w->npackets);
+    w->npackets = 0;
+}
+
+/* Only collects the packets, they are decided by process_batch() */
+static int
+nfqueue_cb(struct nfq_q_handle* qh, struct nfgenmsg* nfmsg,
+    struct nfq_data* nfa, void* data)
+{
+    worker_t* w = data;
+    struct nfqnl_msg_packet_hdr* ph;
+    unsigned char* payload;
+    packet_t* p;
+    int status;
+
+    ph = nfq_get_msg_packet_hdr(nfa);
+    if (unlikely(!ph)) {
+        do_log(LOG_ERR, "NFQUEUE: can't get msg packet header.");
+        __atomic_store_n(&w->errors, w->errors + 1, __ATOMIC_RELAXED);
+        // from nfqueue source: 0 = ok, >0 = soft error, <0 hard error
+        return 1;
+    }
+
+    status = nfq_get_payload(nfa, &payload);
+    if (unlikely(status < 0)) {
+        do_log(LOG_ERR, "NFQUEUE: can't get packet payload.");
+        __atomic_store_n(&w->errors, w->errors + 1, __ATOMIC_RELAXED);
+        return 1;
+    } else if (unlikely(status < (int)sizeof(struct iphdr))) {
+        do_log(LOG_ERR, "NFQUEUE: packet payload too short.");
+        __atomic_store_n(&w->errors, w->errors + 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    if (w->npackets == PACKET_BATCH)
+        process_batch(w);
+    p = &w->packets[w->npackets++];
+    p->id = ntohl(ph->packet_id);
+    p->hook = ph->hook;
+    p->saddr = SRC_ADDR(payload);
+    p->daddr = DST_ADDR(payload);
+#ifdef LATENCY_STATS
+    p->stamp = latency_now();
+#endif
+    PROBE3(packet, w->queue, p->id, p->hook);
+    __atomic_store_n(&w->received, w->received + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+nfqueue_bind_pf()
+{
+    nfqueue_h = nfq_open();
+    if (!nfqueue_h) {
+        do_log(LOG_ERR, "Error during nfq_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    do_log(LOG_INFO, "Unbinding existing nf_queue handler for AF_INET (if any)");
+    if (nfq_unbind_pf(nfqueue_h, AF_INET) < 0) {
+        do_log(LOG_ERR, "Error during nfq_unbind_pf(): %s", strerror(errno));
+        nfq_close(nfqueue_h);
+        nfqueue_h = 0;
+        return -1;
+    }
+
+    do_log(LOG_INFO, "Binding nfnetlink_queue as nf_queue handler for AF_INET");
+    if (nfq_bind_pf(nfqueue_h, AF_INET) < 0) {
+        do_log(LOG_ERR, "Error during nfq_bind_pf(): %s", strerror(errno));
+        nfq_close(nfqueue_h);
+        nfqueue_h = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+nfqueue_unbind_pf()
+{
+    if (!nfqueue_h)
+        return;
+
+    if (nfq_unbind_pf(nfqueue_h, AF_INET) < 0) {
+        do_log(LOG_ERR, "Error during nfq_unbind_pf(): %s", strerror(errno));
+    }
+    nfq_close(nfqueue_h);
+    nfqueue_h = 0;
+}
+
+static int
+nfqueue_bind(worker_t* w)
+{
+    w->h = nfq_open();
+    if (!w->h) {
+        do_log(LOG_ERR, "Error during nfq_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    do_log(LOG_INFO, "NFQUEUE: binding to queue %d", w->queue);
+    w->qh = nfq_create_queue(w->h, w->queue, &nfqueue_cb, w);
+    if (!w->qh) {
+        do_log(LOG_ERR, "error during nfq_create_queue(): %s", strerror(errno));
+        nfq_close(w->h);
+        w->h = 0;
+        return -1;
+    }
+
+    if (nfq_set_mode(w->qh, NFQNL_COPY_PACKET, sizeof(struct iphdr)) < 0) {
+        do_log(LOG_ERR, "can't set packet_copy mode: %s", strerror(errno));
+        nfq_destroy_queue(w->qh);
+        nfq_close(w->h);
+        w->h = 0;
+        return -1;
+    }
+
+    // the following only tune the behaviour under load, so their failures
+    // are not fatal, older kernels do not support all of them
+    if (queue_maxlen && nfq_set_queue_maxlen(w->qh, queue_maxlen) < 0)
+        do_log(LOG_ERR, "can't set queue %d length: %s", w->queue, strerror(errno));
+
+    if (fail_open) {
+#ifdef NFQA_CFG_F_FAIL_OPEN
+        if (nfq_set_queue_flags(w->qh, NFQA_CFG_F_FAIL_OPEN, NFQA_CFG_F_FAIL_OPEN) < 0)
+            do_log(LOG_ERR, "can't set queue %d to fail open: %s", w->queue, strerror(errno));
+#else
+        do_log(LOG_ERR, "fail-open queues are not supported by this build");
+#endif
+    }
+
+    if (rcvbuf_size) {
+        unsigned int size = nfnl_rcvbufsiz(nfq_nfnlh(w->h), rcvbuf_size);
+        if (size < rcvbuf_size)
+            do_log(LOG_ERR, "queue %d receive buffer is only %u bytes", w->queue, size);
+    }
+
+    if (no_enobufs) {
+        int on = 1;
+        if (setsockopt(nfq_fd(w->h), SOL_NETLINK, NETLINK_NO_ENOBUFS, &on, sizeof(on)) < 0)
+            do_log(LOG_ERR, "can't disable ENOBUFS on queue %d: %s", w->queue, strerror(errno));
+    }
+    return 0;
+}
+
+static void
+nfqueue_unbind(worker_t* w)
+{
+    if (!w->h)
+        return;
+
+    do_log(LOG_INFO, "NFQUEUE: unbinding from queue %d", w->queue);
+    nfq_destroy_queue(w->qh);
+    nfq_close(w->h);
+    w->h = 0;
+}
+
+/* Publishes the generation used by the worker, so that the reload
+   does not free it under its hands */
+static generation_t*
+generation_acquire(worker_t* w)
+{
+    generation_t* gen;
+
+    do {
+        gen = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->active, gen, __ATOMIC_SEQ_CST);
+    } while (gen != __atomic_load_n(&current, __ATOMIC_SEQ_CST));
+    return gen;
+}
+
+static void
+generation_release(worker_t* w)
+{
+    __atomic_store_n(&w->active, NULL, __ATOMIC_RELEASE);
+}
+
+/* Collects the packets from the received messages */
+static void
+handle_messages(worker_t* w, char* buf, int len)
+{
+    unsigned int offset = 0;
+    int rv;
+
+    if (!direct_parse) {
+        nfq_handle_packet(w->h, buf, len);
+        return;
+    }
+    for (;;) {
+        if (w->npackets == PACKET_BATCH)
+            process_batch(w);
+        rv = packet_parse(buf, len, &offset, &w->packets[w->npackets]);
+        if (rv == 0)
+            break;
+        if (likely(rv > 0)) {
+#ifdef LATENCY_STATS
+            w->packets[w->npackets].stamp = latency_now();
+#endif
+            PROBE3(packet, w->queue, w->packets[w->npackets].id, w->packets[w->npackets].hook);
+            w->npackets++;
+            __atomic_store_n(&w->received, w->received + 1, __ATOMIC_RELAXED);
+        } else {
+            do_log(LOG_ERR, "NFQUEUE: can't parse packet message.");
+            __atomic_store_n(&w->errors, w->errors + 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* The kernel dropped some packets, the socket is still fine and
+   rebinding would only lose the ones still waiting */
+static void
+count_overrun(worker_t* w)
+{
+    uint64_t overruns = w->overruns + 1;
+
+    __atomic_store_n(&w->overruns, overruns, __ATOMIC_RELAXED);
+    w->curtime = time(NULL);
+    if (w->curtime != w->overrun_logged) {
+        do_log(LOG_ERR, "Buffer overrun on queue %d (%" PRIu64 " so far)",
+            w->queue, overruns);
+        w->overrun_logged = w->curtime;
+    }
+}
+
+/* Counts the loop iterations that began at start and took longer than
+   stall_ms, logging at most one per second */
+static void
+check_stall(worker_t* w, uint64_t start)
+{
+    uint64_t took = now_ns() - start;
+
+    if (!stall_ms || took <= stall_ms * 1000000ull)
+        return;
+    __atomic_store_n(&w->stalls, w->stalls + 1, __ATOMIC_RELAXED);
+    if (took > w->stall_max_ns)
+        __atomic_store_n(&w->stall_max_ns, took, __ATOMIC_RELAXED);
+    if (w->curtime != w->stall_logged) {
+        do_log(LOG_WARNING, "Queue %d: loop iteration took %.1f ms (%" PRIu64 " stalls so far)",
+            w->queue, took / 1e6, w->stalls);
+        w->stall_logged = w->curtime;
+    }
+}
+
+/* Reads the queue with poll() and recvmmsg(), returns 0 when asked
+   to quit, -1 on a fatal error */
+static int
+poll_loop(worker_t* w, int fd)
+{
+    int rv, i;
+    uint64_t start;
+    char* bufs;
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct pollfd fds[2];
+
+    bufs = malloc(RECV_BATCH * RECV_BUFSIZE);
+    CHECK_OOM(bufs);
+    for (i = 0; i < RECV_BATCH; i++) {
+        iovs[i].iov_base = bufs + i * RECV_BUFSIZE;
+        iovs[i].iov_len = RECV_BUFSIZE;
+    }
+
+    for (;;) {
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = quit_pipe[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        rv = poll(fds, 2, -1);
+
+        if (unlikely(rv < 0)) {
+            if (errno == EINTR)
+                continue;
+            do_log(LOG_ERR, "Error waiting for socket: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            free(bufs);
+            return 0;
+        }
+        if (fds[0].revents) {
+            start = now_ns();
+            // read all the queued messages at once
+            for (i = 0; i < RECV_BATCH; i++) {
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            rv = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+            __atomic_store_n(&w->recv_calls, w->recv_calls + 1, __ATOMIC_RELAXED);
+            if (unlikely(rv < 0)) {
+                if (errno == ENOBUFS) {
+                    count_overrun(w);
+                    continue;
+                }
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                do_log(LOG_ERR, "Error reading from socket: %s", strerror(errno));
+                break;
+            }
+            w->curtime = time(NULL);
+            generation_acquire(w);
+            for (i = 0; i < rv; i++)
+                handle_messages(w, iovs[i].iov_base, msgs[i].msg_len);
+            process_batch(w);
+            generation_release(w);
+            check_stall(w, start);
+        }
+    }
+    free(bufs);
+    return -1;
+}
+
+#ifdef HAVE_URING
+/* user_data of the io_uring requests */
+#define URING_RECV 1
+#define URING_QUIT 2
+#define URING_SEND 3
+
+#define URING_ENTRIES 64
+/* provided receive buffers, must be a power of 2 */
+#define URING_BUFFERS 256
+#define URING_BGID 0
+
+typedef struct uring_out_t {
+    char* buf;
+    unsigned int len, size;
+} uring_out_t;
+
+typedef struct uring_state_t {
+    struct io_uring ring;
+    struct io_uring_buf_ring* br;
+    char* bufs;
+    int fd;
+
+    /* verdict messages, out[cur] collects while the other one
+       may be in flight */
+    uring_out_t out[2];
+    int cur;
+    int send_inflight;
+
+    /* provided buffers not taken by the kernel yet, as far as the
+       completions seen tell, and whether the last one taken left none */
+    unsigned int avail;
+    int empty;
+} uring_state_t;
+
+/* The multishot receive stopped because all the provided buffers were
+   taken. Unlike an overrun, nothing was lost, the messages wait in the
+   socket until the receive is armed again. */
+static void
+count_exhausted(worker_t* w)
+{
+    uint64_t exhausted = w->exhausted + 1;
+
+    __atomic_store_n(&w->exhausted, exhausted, __ATOMIC_RELAXED);
+    if (w->curtime != w->exhausted_logged) {
+        do_log(LOG_WARNING, "Queue %d ran out of io_uring receive buffers (%" PRIu64 " so far)",
+            w->queue, exhausted);
+        w->exhausted_logged = w->curtime;
+    }
+}
+
+/* Collects the verdicts, they are sent with the next submission */
+static int
+uring_send(void* arg, const char* buf, unsigned int len)
+{
+    uring_state_t* u = arg;
+    uring_out_t* o = &u->out[u->cur];
+
+    if (o->len + len > o->size) {
+        o->size = (o->len + len) * 2;
+        o->buf = realloc(o->buf, o->size);
+        CHECK_OOM(o->buf);
+    }
+    memcpy(o->buf + o->len, buf, len);
+    o->len += len;
+    return 0;
+}
+
+/* Only one send is in flight at a time, so the verdicts reach the
+   kernel in order; the ones collected meanwhile wait for it */
+static void
+uring_submit_verdicts(uring_state_t* u)
+{
+    struct io_uring_sqe* sqe;
+
+    if (u->send_inflight || !u->out[u->cur].len)
+        return;
+    sqe = io_uring_get_sqe(&u->ring);
+    if (!sqe)
+        return;
+    io_uring_prep_send(sqe, u->fd, u->out[u->cur].buf, u->out[u->cur].len, 0);
+    io_uring_sqe_set_data64(sqe, URING_SEND);
+    u->send_inflight = 1;
+    u->cur ^= 1;
+    u->out[u->cur].len = 0;
+}
+
+static int
+uring_arm(uring_state_t* u, int fd, uint64_t what)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&u->ring);
+
+    if (!sqe)
+        return -1;
+    if (what == URING_RECV) {
+        io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    } else {
+        io_uring_prep_poll_add(sqe, fd, POLLIN);
+    }
+    io_uring_sqe_set_data64(sqe, what);
+    return 0;
+}
+
+/* Reads the queue with a multishot receive into provided buffers and
+   sends the verdicts through the same ring, so waiting, receiving and
+   sending cost one syscall. Returns 0 when asked to quit, -1 on a fatal
+   error and 1 if io_uring is not available. */
+static int
+uring_loop(worker_t* w, int fd)
+{
+    uring_state_t u;
+    struct io_uring_cqe* cqe;
+    unsigned int head, count, added;
+    uint64_t start;
+    int i, rv, ret = -1, quit = 0, recv_armed = 0;
+
+    memset(&u, 0, sizeof(u));
+    u.fd = fd;
+    rv = io_uring_queue_init(URING_ENTRIES, &u.ring, 0);
+    if (rv < 0) {
+        do_log(LOG_INFO, "io_uring not available (%s), using poll", strerror(-rv));
+        return 1;
+    }
+    u.br = io_uring_setup_buf_ring(&u.ring, URING_BUFFERS, URING_BGID, 0, &rv);
+    if (!u.br) {
+        do_log(LOG_INFO, "io_uring buffer rings not available (%s), using poll", strerror(-rv));
+        io_uring_queue_exit(&u.ring);
+        return 1;
+    }
+    u.bufs = malloc(URING_BUFFERS * RECV_BUFSIZE);
+    CHECK_OOM(u.bufs);
+    for (i = 0; i < URING_BUFFERS; i++)
+        io_uring_buf_ring_add(u.br, u.bufs + i * RECV_BUFSIZE, RECV_BUFSIZE, i,
+            io_uring_buf_ring_mask(URING_BUFFERS), i);
+    io_uring_buf_ring_advance(u.br, URING_BUFFERS);
+    u.avail = URING_BUFFERS;
+    verdict_set_sender(&w->verdicts, uring_send, &u);
+
+    if (uring_arm(&u, quit_pipe[0], URING_QUIT) < 0)
+        goto out;
 
-#ifndef LOWMEM
-                    do_log(LOG_NOTICE, "Blocked FWD: %s->%s, hits: %d,%d, SRC: %s, DST: %s",
-                        src ? sranges[0] : "(unknown)", dst ? dranges[0] : "(unknown)",
-                        src ? src->hits : 0, dst ? dst->hits : 0, buf1, buf2);
-#else
-                    do_log(LOG_NOTICE, "Blocked FWD: hits: %d,%d, SRC: %s, DST: %s",
-                        src ? src->hits : 0, dst ? dst->hits : 0, buf1, buf2);
-#endif
+    for (;;) {
+        if (!recv_armed) {
+            if (uring_arm(&u, fd, URING_RECV) < 0)
+                goto out;
+            recv_armed = 1;
+        }
+        rv = io_uring_submit_and_wait(&u.ring, 1);
+        __atomic_store_n(&w->recv_calls, w->recv_calls + 1, __ATOMIC_RELAXED);
+        if (unlikely(rv < 0)) {
+            if (rv == -EINTR)
+                continue;
+            do_log(LOG_ERR, "Error waiting for socket: %s", strerror(-rv));
+            goto out;
+        }
+
+        start = now_ns();
+        w->curtime = time(NULL);
+        generation_acquire(w);
+        count = added = 0;
+        io_uring_for_each_cqe(&u.ring, head, cqe)
+        {
+            count++;
+            switch (io_uring_cqe_get_data64(cqe)) {
+            case URING_RECV:
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    recv_armed = 0;
+                if (cqe->res < 0) {
+                    // either the buffer ring ran out, when the last
+                    // buffer taken was the last one provided, or the
+                    // socket overflowed
+                    if (cqe->res == -ENOBUFS) {
+                        if (u.empty)
+                            count_exhausted(w);
+                        else
+                            count_overrun(w);
+                        u.empty = 0;
+                    } else if (cqe->res != -EINTR) {
+                        do_log(LOG_ERR, "Error reading from socket: %s", strerror(-cqe->res));
+                        quit = -1;
+                    }
+                } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    char* buf = u.bufs + bid * RECV_BUFSIZE;
+                    u.avail--;
+                    u.empty = u.avail == 0;
+                    handle_messages(w, buf, cqe->res);
+                    // the packets were copied out, the buffer can be reused
+                    io_uring_buf_ring_add(u.br, buf, RECV_BUFSIZE, bid,
+                        io_uring_buf_ring_mask(URING_BUFFERS), added++);
                 }
+                break;
+            case URING_SEND:
+                u.send_inflight = 0;
+                if (cqe->res < 0)
+                    check_set_verdict_status(-1);
+                break;
+            case URING_QUIT:
+                quit = 1;
+                break;
             }
-        } else if (unlikely(accept_mark)) {
-            // we set the user-defined accept_mark and set NF_REPEAT verdict
-            // it's up to other iptables rules to decide what to do with this marked packet
-            status = nfq_set_verdict2(qh, id, NF_REPEAT, accept_mark, 0, NULL);
-            check_set_verdict_status(status);
-        } else {
-            // no accept_mark, just NF_ACCEPT the packet
-            status = nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
-            check_set_verdict_status(status);
         }
-        break;
-    default:
-        do_log(LOG_NOTICE, "Not NF_LOCAL_IN/OUT/FORWARD packet!");
-        break;
+        io_uring_cq_advance(&u.ring, count);
+        if (added) {
+            io_uring_buf_ring_advance(u.br, added);
+            u.avail += added;
+        }
+        process_batch(w);
+        generation_release(w);
+
+        if (quit) {
+            ret = quit > 0 ? 0 : -1;
+            break;
+        }
+        uring_submit_verdicts(&u);
+        check_stall(w, start);
     }
 
-    return 0;
+out:
+    verdict_set_sender(&w->verdicts, NULL, NULL);
+    // the buffer of a send in flight must stay valid until it completes
+    while (u.send_inflight && io_uring_wait_cqe(&u.ring, &cqe) == 0) {
+        if (io_uring_cqe_get_data64(cqe) == URING_SEND)
+            u.send_inflight = 0;
+        io_uring_cqe_seen(&u.ring, cqe);
+    }
+    if (u.out[u.cur].len && send(fd, u.out[u.cur].buf, u.out[u.cur].len, 0) < 0)
+        check_set_verdict_status(-1);
+    io_uring_free_buf_ring(&u.ring, u.br, URING_BUFFERS, URING_BGID);
+    io_uring_queue_exit(&u.ring);
+    free(u.bufs);
+    free(u.out[0].buf);
+    free(u.out[1].buf);
+    return ret;
 }
+#endif
 
-static int
-nfqueue_bind()
+static void*
+nfqueue_loop(void* arg)
 {
-    nfqueue_h = nfq_open();
-    if (!nfqueue_h) {
-        do_log(LOG_ERR, "Error during nfq_open(): %s", strerror(errno));
-        return -1;
+    worker_t* w = arg;
+    struct nfnl_handle* nh;
+    int fd, rv;
+
+    log_async = logring_running;
+
+    if (w->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rv != 0)
+            do_log(LOG_ERR, "Cannot pin queue %d to CPU %d: %s",
+                w->queue, w->cpu, strerror(rv));
     }
 
-    do_log(LOG_INFO, "Unbinding existing nf_queue handler for AF_INET (if any)");
-    if (nfq_unbind_pf(nfqueue_h, AF_INET) < 0) {
-        do_log(LOG_ERR, "Error during nfq_unbind_pf(): %s", strerror(errno));
-        return -1;
+    if (nfqueue_bind(w) < 0)
+        goto out_err;
+
+    nh = nfq_nfnlh(w->h);
+    fd = nfnl_fd(nh);
+    verdict_init(&w->verdicts, fd, w->queue,
+        accept_mark ? NF_REPEAT : NF_ACCEPT, accept_mark);
+
+    rv = 1;
+#ifdef HAVE_URING
+    if (use_uring)
+        rv = uring_loop(w, fd);
+#endif
+    if (rv > 0)
+        rv = poll_loop(w, fd);
+    verdict_free(&w->verdicts);
+    if (rv < 0)
+        goto out_err;
+    nfqueue_unbind(w);
+    return NULL;
+
+out_err:
+    nfqueue_unbind(w);
+    // let the control thread shut down the other workers
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+/* seconds between the updates of the stats file, and between the
+   checks whether the kernel queues are due to be sampled */
+#define STATS_FILE_INTERVAL 1
+
+static shmstats_t* stats_file = NULL;
+
+/* Copies the counters into the stats file. Only called from the
+   control thread, so current cannot change meanwhile. */
+static void
+publish_stats()
+{
+    shmstats_t* s = stats_file;
+    generation_t* gen = current;
+    uint64_t total = 0;
+    unsigned int i;
+    int j, k;
+
+    if (!s)
+        return;
+    shmstats_begin(s);
+    s->updated = time(NULL);
+    memset(s->packets, 0, sizeof(s->packets));
+    memset(s->verdicts, 0, sizeof(s->verdicts));
+    s->errors = s->overruns = 0;
+    for (j = 0; j < worker_count; j++) {
+        worker_t* w = &workers[j];
+        for (k = 0; k < SHMSTATS_HOOKS; k++)
+            s->packets[k] += __atomic_load_n(&w->hooks[k], __ATOMIC_RELAXED);
+        for (k = 0; k < SHMSTATS_VERDICTS; k++)
+            s->verdicts[k] += __atomic_load_n(&w->actions[k], __ATOMIC_RELAXED);
+        s->errors += __atomic_load_n(&w->errors, __ATOMIC_RELAXED);
+        s->overruns += __atomic_load_n(&w->overruns, __ATOMIC_RELAXED);
     }
+    s->log_dropped = logring_dropped();
+    for (i = 0; i < s->range_count; i++) {
+        uint64_t hits = 0;
+        for (k = 0; k < gen->counter_count; k++)
+            hits += __atomic_load_n(&gen->counters[k][i].hits, __ATOMIC_RELAXED);
+        s->ranges[i].hits = hits;
+        total += hits;
+    }
+    s->hits = total;
+    shmstats_end(s);
+}
 
-    do_log(LOG_INFO, "Binding nfnetlink_queue as nf_queue handler for AF_INET");
-    if (nfq_bind_pf(nfqueue_h, AF_INET) < 0) {
-        do_log(LOG_ERR, "Error during nfq_bind_pf(): %s", strerror(errno));
-        nfq_close(nfqueue_h);
-        return -1;
+/* Replaces the stats file with one for the ranges of gen. The readers
+   of the old one see it superseded and open the new one. */
+static void
+stats_file_open(generation_t* gen)
+{
+    blocklist_t* bl = &gen->blocklist;
+    shmstats_t* s;
+    unsigned int i;
+
+    if (!stats_file_name)
+        return;
+    s = shmstats_create(stats_file_name, bl->count);
+    if (!s)
+        do_log(LOG_ERR, "Cannot create stats file %s: %s",
+            stats_file_name, strerror(errno));
+    // the old file does not match the new ranges anymore
+    if (stats_file)
+        shmstats_close(stats_file, stats_file_name, s == NULL);
+    stats_file = s;
+    if (!s)
+        return;
+
+    s->generation = gen->serial;
+    s->loaded = gen->loaded;
+    s->load_usec = gen->load_usec;
+    for (i = 0; i < bl->count; i++) {
+        s->ranges[i].ip_min = bl->entries[i].ip_min;
+        s->ranges[i].ip_max = bl->entries[i].ip_max;
     }
+    shmstats_end(s);
+    publish_stats();
+}
 
-    do_log(LOG_INFO, "NFQUEUE: binding to queue %d", queue_num);
-    nfqueue_qh = nfq_create_queue(nfqueue_h, queue_num, &nfqueue_cb, NULL);
-    if (!nfqueue_qh) {
-        do_log(LOG_ERR, "error during nfq_create_queue(): %s", strerror(errno));
-        nfq_close(nfqueue_h);
-        return -1;
+static void
+stats_file_close()
+{
+    if (stats_file)
+        shmstats_close(stats_file, stats_file_name, 1);
+    stats_file = NULL;
+}
+
+/* Figures of the current generation, for the metrics thread which
+   does not take part in the generation handover */
+typedef struct generation_info_t {
+    uint64_t serial, load_usec, ranges;
+    /* used by the blocklist arenas, and the hit counters of the workers */
+    uint64_t arena_bytes, counter_bytes;
+} generation_info_t;
+
+static generation_info_t current_info;
+
+static void
+generation_publish(generation_t* gen)
+{
+    uint64_t count = gen->blocklist.count;
+    uint64_t arena_bytes = arena_used(&gen->blocklist.arena);
+
+#ifndef LOWMEM
+    arena_bytes += arena_used(&gen->blocklist.label_arena);
+#endif
+    __atomic_store_n(&current_info.serial, gen->serial, __ATOMIC_RELAXED);
+    __atomic_store_n(&current_info.load_usec, gen->load_usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&current_info.ranges, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&current_info.arena_bytes, arena_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&current_info.counter_bytes,
+        count * (sizeof(hit_counter_t) * gen->counter_count + sizeof(time_t)),
+        __ATOMIC_RELAXED);
+}
+
+#define METRIC(out, name, type, help) \
+    fprintf(out, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+/* Runs on the metrics thread, so it only reads the counters the
+   workers keep anyway */
+static void
+write_metrics(FILE* out)
+{
+    static const char* const hooks[SHMSTATS_HOOKS] = { "in", "out", "forward", "other" };
+    static const char* const verdicts[SHMSTATS_VERDICTS] = { "drop", "mark", "log", "accept" };
+    uint64_t sums[SHMSTATS_HOOKS + SHMSTATS_VERDICTS] = { 0 };
+    uint64_t errors = 0, overruns = 0, exhausted = 0;
+    histogram_t* h;
+    int i, k;
+
+    for (i = 0; i < worker_count; i++) {
+        worker_t* w = &workers[i];
+        for (k = 0; k < SHMSTATS_HOOKS; k++)
+            sums[k] += __atomic_load_n(&w->hooks[k], __ATOMIC_RELAXED);
+        for (k = 0; k < SHMSTATS_VERDICTS; k++)
+            sums[SHMSTATS_HOOKS + k] += __atomic_load_n(&w->actions[k], __ATOMIC_RELAXED);
+        errors += __atomic_load_n(&w->errors, __ATOMIC_RELAXED);
+        overruns += __atomic_load_n(&w->overruns, __ATOMIC_RELAXED);
+        exhausted += __atomic_load_n(&w->exhausted, __ATOMIC_RELAXED);
     }
 
-    if (nfq_set_mode(nfqueue_qh, NFQNL_COPY_PACKET, sizeof(struct iphdr)) < 0) {
-        do_log(LOG_ERR, "can't set packet_copy mode: %s", strerror(errno));
-        nfq_destroy_queue(nfqueue_qh);
-        nfq_close(nfqueue_h);
-        return -1;
+    METRIC(out, "nfblockd_packets_total", "counter", "Packets received, by hook.");
+    for (k = 0; k < SHMSTATS_HOOKS; k++)
+        fprintf(out, "nfblockd_packets_total{hook=\"%s\"} %" PRIu64 "\n", hooks[k], sums[k]);
+    METRIC(out, "nfblockd_verdicts_total", "counter", "Verdicts, by action.");
+    for (k = 0; k < SHMSTATS_VERDICTS; k++)
+        fprintf(out, "nfblockd_verdicts_total{verdict=\"%s\"} %" PRIu64 "\n",
+            verdicts[k], sums[SHMSTATS_HOOKS + k]);
+    METRIC(out, "nfblockd_list_hits_total", "counter", "Packets matching a list.");
+    for (i = 0; i < list_count; i++) {
+        uint64_t hits = 0;
+        for (k = 0; k < worker_count; k++)
+            hits += __atomic_load_n(&workers[k].list_hits[i], __ATOMIC_RELAXED);
+        fprintf(out, "nfblockd_list_hits_total{list=");
+        metrics_label(out, lists[i].name);
+        fprintf(out, "} %" PRIu64 "\n", hits);
     }
-    return 0;
+    METRIC(out, "nfblockd_bad_packets_total", "counter", "Packets that could not be parsed.");
+    fprintf(out, "nfblockd_bad_packets_total %" PRIu64 "\n", errors);
+    METRIC(out, "nfblockd_overruns_total", "counter", "Netlink receive buffer overruns.");
+    fprintf(out, "nfblockd_overruns_total %" PRIu64 "\n", overruns);
+#ifdef HAVE_URING
+    METRIC(out, "nfblockd_uring_buffers_exhausted_total", "counter",
+        "Times io_uring ran out of provided receive buffers.");
+    fprintf(out, "nfblockd_uring_buffers_exhausted_total %" PRIu64 "\n", exhausted);
+#endif
+    METRIC(out, "nfblockd_log_dropped_total", "counter", "Log messages dropped.");
+    fprintf(out, "nfblockd_log_dropped_total %" PRIu64 "\n", logring_dropped());
+
+    h = calloc(1, sizeof(histogram_t));
+    CHECK_OOM(h);
+    for (i = 0; i < worker_count; i++)
+        histogram_merge(h, &workers[i].lookup_ns);
+    metrics_histogram(out, "nfblockd_lookup_batch_seconds",
+        "Time taken by the lookups of a batch of packets.", h);
+    memset(h, 0, sizeof(histogram_t));
+    for (i = 0; i < worker_count; i++)
+        histogram_merge(h, &workers[i].verdict_ns);
+    metrics_histogram(out, "nfblockd_verdict_batch_seconds",
+        "Time taken by deciding and sending the verdicts of a batch of packets.", h);
+    free(h);
+
+    METRIC(out, "nfblockd_blocklist_loads_total", "counter", "Blocklist loads, including the first one.");
+    fprintf(out, "nfblockd_blocklist_loads_total %" PRIu64 "\n",
+        __atomic_load_n(&current_info.serial, __ATOMIC_RELAXED));
+    METRIC(out, "nfblockd_blocklist_load_seconds", "gauge", "Duration of the last blocklist load.");
+    fprintf(out, "nfblockd_blocklist_load_seconds %.6f\n",
+        __atomic_load_n(&current_info.load_usec, __ATOMIC_RELAXED) / 1e6);
+    METRIC(out, "nfblockd_blocklist_ranges", "gauge", "Ranges in the blocklist.");
+    fprintf(out, "nfblockd_blocklist_ranges %" PRIu64 "\n",
+        __atomic_load_n(&current_info.ranges, __ATOMIC_RELAXED));
+
+    METRIC(out, "nfblockd_memory_bytes", "gauge", "Memory used, by structure.");
+    fprintf(out, "nfblockd_memory_bytes{structure=\"blocklist\"} %" PRIu64 "\n",
+        __atomic_load_n(&current_info.arena_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "nfblockd_memory_bytes{structure=\"hit_counters\"} %" PRIu64 "\n",
+        __atomic_load_n(&current_info.counter_bytes, __ATOMIC_RELAXED));
+    fprintf(out, "nfblockd_memory_bytes{structure=\"workers\"} %zu\n",
+        sizeof(worker_t) * worker_count);
 }
 
+/* Builds a new generation of the blocklist and frees the old one
+   once no worker uses it anymore */
 static void
-nfqueue_unbind()
+reload_lists()
 {
-    if (!nfqueue_h)
-        return;
+    generation_t *old = current, *gen;
+    uint64_t start = now_ns(), swapped, took;
+    int i;
 
-    do_log(LOG_INFO, "NFQUEUE: unbinding from queue 0");
-    nfq_destroy_queue(nfqueue_qh);
-    if (nfq_unbind_pf(nfqueue_h, AF_INET) < 0) {
-        do_log(LOG_ERR, "Error during nfq_unbind_pf(): %s", strerror(errno));
+    if (generation_load(&gen) < 0)
+        do_log(LOG_ERR, "Cannot load the blocklist");
+    swapped = now_ns();
+
+    __atomic_store_n(&current, gen, __ATOMIC_SEQ_CST);
+    PROBE3(reload_swap, old->serial, gen->serial, gen->blocklist.count);
+    generation_publish(gen);
+    stats_file_open(gen);
+    for (i = 0; i < worker_count; i++) {
+        while (__atomic_load_n(&workers[i].active, __ATOMIC_SEQ_CST) == old)
+            usleep(1000);
     }
-    nfq_close(nfqueue_h);
+    // the statistics being dumped still refer to the old entries
+    while (__atomic_load_n(&stats_gen, __ATOMIC_SEQ_CST) == old)
+        usleep(1000);
+    PROBE1(reload_freed, old->serial);
+    generation_free(old);
+    do_log(LOG_INFO, "Blocklist reloaded");
+    took = now_ns() - start;
+    if (stall_ms && took > stall_ms * 1000000ull)
+        do_log(LOG_WARNING, "Reload took %.1f ms: %.1f ms loading, %.1f ms "
+            "waiting for the workers", took / 1e6, (swapped - start) / 1e6,
+            (took - (swapped - start)) / 1e6);
 }
 
+/* Starts a worker for each queue and handles the signals until
+   asked to quit */
 static int
-nfqueue_loop()
+run_workers()
 {
-    struct nfnl_handle* nh;
-    int fd, rv;
-    char buf[2048];
-    struct pollfd fds[1];
-
-restart:
-    if (nfqueue_bind() < 0)
+    sigset_t set;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, sig, ret = 0, started = worker_count;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    // the workers inherit the mask, only this thread gets the signals
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pipe(quit_pipe) < 0) {
+        do_log(LOG_ERR, "Cannot create pipe: %s", strerror(errno));
         return -1;
+    }
 
-    nh = nfq_nfnlh(nfqueue_h);
-    fd = nfnl_fd(nh);
+    if (logring_start(log_output) < 0)
+        do_log(LOG_ERR, "Cannot start the logging thread, logging synchronously");
+    else
+        logring_running = 1;
 
-    for (;;) {
-        fds[0].fd = fd;
-        fds[0].events = POLLIN;
-        fds[0].revents = 0;
-        rv = poll(fds, 1, 5000);
+    if (stats_start() < 0)
+        do_log(LOG_ERR, "Cannot start the statistics thread, dumping synchronously");
 
-        curtime = time(NULL);
+#ifdef LATENCY_STATS
+    ns_per_tick = latency_calibrate();
+#endif
+    generation_publish(current);
+    if (metrics_socket_name)
+        metrics_start(metrics_socket_name, write_metrics, do_log);
 
-        if (unlikely(rv < 0)) {
-            if (errno == EINTR)
-                continue;
-            do_log(LOG_ERR, "Error waiting for socket: %s", strerror(errno));
+#ifdef HAVE_DBUS
+    // the plugin is only called from this thread
+    if (use_dbus && dbusq_start(nfblock_dbus_send_blocked, do_log, dbus_rate) < 0) {
+        do_log(LOG_ERR, "Cannot start the D-Bus thread");
+        use_dbus = 0;
+    }
+#endif
+
+    if (nfqueue_bind_pf() < 0) {
+        ret = -1;
+        goto out_pipe;
+    }
+
+    for (i = 0; i < worker_count; i++) {
+        worker_t* w = &workers[i];
+        w->index = i;
+        w->queue = queue_num + i;
+        w->cpu = pin_workers && ncpus > 0 ? i % ncpus : -1;
+        if (pthread_create(&w->thread, NULL, nfqueue_loop, w) != 0) {
+            do_log(LOG_ERR, "Cannot start the worker for queue %d", w->queue);
+            started = i;
+            ret = -1;
             goto out;
         }
-        if (rv > 0) {
-            rv = recv(fd, buf, sizeof(buf), 0);
-            if (unlikely(rv < 0)) {
-                if (errno == ENOBUFS) {
-                    do_log(LOG_ERR, "Buffer overrun, restarting");
-                    nfqueue_unbind();
-                    goto restart;
-                }
-                if (errno == EINTR)
+    }
+
+    stats_file_open(current);
+    queue_samples = calloc(worker_count, sizeof(queue_sample_t));
+    CHECK_OOM(queue_samples);
+    if (sample_kernel)
+        sample_queues();
+    for (;;) {
+        if (stats_file || sample_kernel) {
+            struct timespec timeout = { STATS_FILE_INTERVAL, 0 };
+
+            sig = sigtimedwait(&set, NULL, &timeout);
+            if (sig < 0) {
+                if (errno != EAGAIN)
                     continue;
-                do_log(LOG_ERR, "Error reading from socket: %s", strerror(errno));
-                goto out;
+                if (stats_file)
+                    publish_stats();
+                if (sample_kernel && now_ns() - samples_ns >= QUEUE_SAMPLE_INTERVAL * 1000000000ull)
+                    sample_queues();
+                continue;
             }
-            if (rv >= 0)
-                nfq_handle_packet(nfqueue_h, buf, rv);
+        } else if (sigwait(&set, &sig) != 0) {
+            continue;
         }
-
-        if (unlikely(command != CMD_NONE)) {
-            switch (command) {
-            case CMD_DUMPSTATS:
-                blocklist_stats(&blocklist);
-                break;
-            case CMD_RELOAD:
-                blocklist_stats(&blocklist);
-                if (load_all_lists() < 0)
-                    do_log(LOG_ERR, "Cannot load the blocklist");
-                do_log(LOG_INFO, "Blocklist reloaded");
-                break;
-            case CMD_QUIT:
-                goto out;
-            default:
-                break;
-            }
-            command = CMD_NONE;
+        switch (sig) {
+        case SIGUSR1:
+            request_stats();
+            break;
+        case SIGHUP:
+            request_stats();
+            reload_lists();
+            break;
+        case SIGTERM:
+        case SIGINT:
+            goto out;
+        default:
+            break;
         }
     }
+
 out:
-    nfqueue_unbind();
-    return 0;
+    if (write(quit_pipe[1], "q", 1) < 0)
+        do_log(LOG_ERR, "Cannot stop the workers: %s", strerror(errno));
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    nfqueue_unbind_pf();
+out_pipe:
+    metrics_stop();
+    stats_file_close();
+    stats_stop();
+    free(queue_samples);
+    queue_samples = NULL;
+#ifdef HAVE_DBUS
+    if (use_dbus)
+        dbusq_stop();
+#endif
+    if (logring_running) {
+        logring_stop();
+        logring_running = 0;
+    }
+    close(quit_pipe[0]);
+    close(quit_pipe[1]);
+    return ret;
 }
 
 static void
 sighandler(int sig, siginfo_t* info, void* context)
 {
     switch (sig) {
-    case SIGUSR1:
-        command = CMD_DUMPSTATS;
-        break;
-    case SIGHUP:
-        command = CMD_RELOAD;
-        break;
-    case SIGTERM:
-    case SIGINT:
-        command = CMD_QUIT;
-        break;
     case SIGSEGV:
-        nfqueue_unbind();
+        nfqueue_unbind_pf();
         abort();
         break;
     default:
@@ -553,22 +2127,6 @@ install_sighandler()
     sa.sa_sigaction = sighandler;
     sa.sa_flags = SA_RESTART | SA_SIGINFO;
 
-    if (sigaction(SIGUSR1, &sa, NULL) < 0) {
-        perror("Error setting signal handler for SIGUSR1\n");
-        return -1;
-    }
-    if (sigaction(SIGHUP, &sa, NULL) < 0) {
-        perror("Error setting signal handler for SIGHUP\n");
-        return -1;
-    }
-    if (sigaction(SIGTERM, &sa, NULL) < 0) {
-        perror("Error setting signal handler for SIGTERM\n");
-        return -1;
-    }
-    if (sigaction(SIGINT, &sa, NULL) < 0) {
-        perror("Error setting signal handler for SIGINT\n");
-        return -1;
-    }
     if (sigaction(SIGSEGV, &sa, NULL) < 0) {
         perror("Error setting signal handler for SIGABRT\n");
         return -1;
@@ -650,63 +2208,333 @@ do_benchmark()
     for (i = 0; i < ITER; i++) {
         uint32_t ip;
         ip = (uint32_t)random() ^ ((uint32_t)random() << 16);
-        blocklist_find(&blocklist, ip, 0, 0);
+        blocklist_find(&current->blocklist, ip);
     }
     end = ustime();
 
     fprintf(stderr, "%" PRIi64 " matches per second.\n", ((int64_t)1000000) * ITER / (end - start));
 }
 
+#define TRACE_PACKETS 4096
+#define TRACE_MSGSIZE 128
+#define PARSE_ITER 256
+
+static void*
+put_bench_attr(char* p, uint16_t type, const void* data, uint16_t len)
+{
+    struct nlattr* nla = (struct nlattr*)p;
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(p + NLA_HDRLEN, data, len);
+    return p + NLA_ALIGN(nla->nla_len);
+}
+
+/* Builds packet messages laid out the way the kernel sends them,
+   one per slot */
+static char*
+build_trace(unsigned int* lens)
+{
+    char* trace = calloc(TRACE_PACKETS, TRACE_MSGSIZE);
+    int i;
+
+    CHECK_OOM(trace);
+    for (i = 0; i < TRACE_PACKETS; i++) {
+        char* p = trace + i * TRACE_MSGSIZE;
+        struct nlmsghdr* nlh = (struct nlmsghdr*)p;
+        struct nfgenmsg* nfg = (struct nfgenmsg*)(p + NLMSG_HDRLEN);
+        struct nfqnl_msg_packet_hdr ph;
+        struct iphdr ip;
+        uint32_t ifindex = htonl(2);
+
+        nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET;
+        nfg->nfgen_family = AF_INET;
+        nfg->version = NFNETLINK_V0;
+        nfg->res_id = htons(queue_num);
+        p = (char*)nfg + NLMSG_ALIGN(sizeof(*nfg));
+
+        ph.packet_id = htonl(i + 1);
+        ph.hw_protocol = htons(0x0800);
+        ph.hook = i % 3 == 0 ? NF_IP_LOCAL_IN : i % 3 == 1 ? NF_IP_LOCAL_OUT : NF_IP_FORWARD;
+        p = put_bench_attr(p, NFQA_PACKET_HDR, &ph, sizeof(ph));
+        p = put_bench_attr(p, NFQA_IFINDEX_INDEV, &ifindex, sizeof(ifindex));
+        memset(&ip, 0, sizeof(ip));
+        ip.saddr = (uint32_t)random() ^ ((uint32_t)random() << 16);
+        ip.daddr = (uint32_t)random() ^ ((uint32_t)random() << 16);
+        p = put_bench_attr(p, NFQA_PAYLOAD, &ip, sizeof(ip));
+        nlh->nlmsg_len = p - (char*)nlh;
+        lens[i] = nlh->nlmsg_len;
+    }
+    return trace;
+}
+
+typedef struct bench_packets_t {
+    packet_t* packets;
+    int count;
+} bench_packets_t;
+
+/* The work nfqueue_cb() does before the lookup */
+static int
+bench_cb(struct nfq_q_handle* qh, struct nfgenmsg* nfmsg,
+    struct nfq_data* nfa, void* data)
+{
+    bench_packets_t* b = data;
+    struct nfqnl_msg_packet_hdr* ph = nfq_get_msg_packet_hdr(nfa);
+    packet_t* p = &b->packets[b->count++ % TRACE_PACKETS];
+    unsigned char* payload;
+
+    if (!ph || nfq_get_payload(nfa, &payload) < (int)sizeof(struct iphdr))
+        return 1;
+    p->id = ntohl(ph->packet_id);
+    p->hook = ph->hook;
+    p->saddr = SRC_ADDR(payload);
+    p->daddr = DST_ADDR(payload);
+    return 0;
+}
+
+/* Compares packet_parse() with libnetfilter_queue over the same trace */
+static void
+do_parse_benchmark()
+{
+    unsigned int lens[TRACE_PACKETS], offset;
+    char* trace = build_trace(lens);
+    packet_t *direct, *library;
+    bench_packets_t b;
+    struct nfq_handle* h;
+    struct nfq_q_handle* qh;
+    int64_t start, end;
+    int i, j;
+
+    direct = calloc(TRACE_PACKETS, sizeof(packet_t));
+    library = calloc(TRACE_PACKETS, sizeof(packet_t));
+    CHECK_OOM(direct);
+    CHECK_OOM(library);
+
+    start = ustime();
+    for (j = 0; j < PARSE_ITER; j++) {
+        for (i = 0; i < TRACE_PACKETS; i++) {
+            offset = 0;
+            packet_parse(trace + i * TRACE_MSGSIZE, lens[i], &offset, &direct[i]);
+        }
+    }
+    end = ustime();
+    fprintf(stderr, "packet_parse: %.1f ns per packet.\n",
+        (end - start) * 1000.0 / ((int64_t)PARSE_ITER * TRACE_PACKETS));
+
+    // the library only dispatches to a queue bound in the kernel
+    h = nfq_open();
+    qh = h ? nfq_create_queue(h, queue_num, &bench_cb, &b) : NULL;
+    if (!qh) {
+        fprintf(stderr, "libnetfilter_queue: cannot bind queue %d: %s\n", queue_num, strerror(errno));
+    } else {
+        b.packets = library;
+        b.count = 0;
+        start = ustime();
+        for (j = 0; j < PARSE_ITER; j++)
+            for (i = 0; i < TRACE_PACKETS; i++)
+                nfq_handle_packet(h, trace + i * TRACE_MSGSIZE, lens[i]);
+        end = ustime();
+        fprintf(stderr, "libnetfilter_queue: %.1f ns per packet.\n",
+            (end - start) * 1000.0 / ((int64_t)PARSE_ITER * TRACE_PACKETS));
+        if (memcmp(direct, library, sizeof(packet_t) * TRACE_PACKETS) != 0)
+            fprintf(stderr, "The results differ!\n");
+        nfq_destroy_queue(qh);
+    }
+    if (h)
+        nfq_close(h);
+    free(direct);
+    free(library);
+    free(trace);
+}
+
 static void
 print_usage()
 {
     fprintf(stderr, "nfblockd " VERSION " (c) 2008 Jindrich Makovicka\n");
-    fprintf(stderr, "Syntax: nfblockd -d [-a MARK] [-r MARK] [-q 0-65535] BLOCKLIST...\n\n");
+    fprintf(stderr, "Syntax: nfblockd -d [-a MARK] [-r MARK] [-q QUEUE[-LAST]] BLOCKLIST...\n\n");
     fprintf(stderr, "        -d            Run as daemon\n");
 #ifndef LOWMEM
     fprintf(stderr, "        -c            Blocklist file charset (for all following filenames)\n");
 #endif
     fprintf(stderr, "        -f            Blocklist file name\n");
+#ifndef LOWMEM
+    fprintf(stderr, "        -L NAME=FILE  Blocklist file name, belonging to the list NAME\n");
+    fprintf(stderr, "        -A NAME=ACTION  Action for the list NAME: drop, mark:MARK or log\n");
+#endif
     fprintf(stderr, "        -p NAME       Use a pidfile named NAME\n");
     fprintf(stderr, "        -v            Verbose output\n");
-    fprintf(stderr, "        -b            Benchmark IP matches per second\n");
+    fprintf(stderr, "        -b            Benchmark IP matches per second and packet parsing\n");
     fprintf(stderr, "        -q 0-65535    NFQUEUE number, as specified in --queue-num with iptables\n");
+    fprintf(stderr, "        -q FIRST-LAST NFQUEUE range, as specified in --queue-balance with iptables,\n");
+    fprintf(stderr, "                      served by one thread per queue\n");
     fprintf(stderr, "        -a MARK       32-bit mark to place on ACCEPTED packets\n");
     fprintf(stderr, "        -r MARK       32-bit mark to place on REJECTED packets\n");
     fprintf(stderr, "        --no-syslog   Disable hit logging to the system log\n");
+    fprintf(stderr, "        --sort-threads N  Number of threads used to sort large blocklists\n");
+    fprintf(stderr, "        --merge-report FILE  List the merged ranges in FILE\n");
+    fprintf(stderr, "        --stats-top N Show the N most hit ranges in the statistics, 0 for all\n");
+    fprintf(stderr, "        --stats-file FILE  Publish the statistics in a memory mapped FILE\n");
+    fprintf(stderr, "        --metrics-socket PATH  Serve Prometheus metrics on a Unix socket\n");
+    fprintf(stderr, "        --stall-ms N  Report loop iterations, reloads and statistics dumps over N ms\n");
+    fprintf(stderr, "        --top-report FILE  Write the most blocked addresses to FILE with the statistics\n");
+    fprintf(stderr, "        --pin-workers Pin the queue threads to separate CPUs\n");
+    fprintf(stderr, "        --rcvbuf BYTES  Netlink socket receive buffer size\n");
+    fprintf(stderr, "        --queue-maxlen N  Maximum number of packets waiting in the kernel queue\n");
+    fprintf(stderr, "        --fail-open   Accept the packets when the kernel queue is full\n");
+    fprintf(stderr, "        --no-enobufs  Do not report receive buffer overruns\n");
+    fprintf(stderr, "        --direct-parse  Parse the packet messages without libnetfilter_queue\n");
+    fprintf(stderr, "        --allow FILE  Never block the ranges listed in FILE\n");
 #ifdef HAVE_DBUS
     fprintf(stderr, "        --no-dbus     Disable D-Bus support for hit reporting\n");
+    fprintf(stderr, "        --dbus-rate N Send at most N D-Bus signals per second\n");
+#endif
+#ifdef HAVE_URING
+    fprintf(stderr, "        --no-uring    Read the queues with poll() instead of io_uring\n");
 #endif
     fprintf(stderr, "\n");
 }
 
 enum long_option {
     OPTION_NO_SYSLOG = CHAR_MAX + 1,
-    OPTION_NO_DBUS
+    OPTION_NO_DBUS,
+    OPTION_SORT_THREADS,
+    OPTION_MERGE_REPORT,
+    OPTION_TOP_REPORT,
+    OPTION_STATS_TOP,
+    OPTION_STATS_FILE,
+    OPTION_METRICS_SOCKET,
+    OPTION_STALL_MS,
+    OPTION_ALLOW,
+    OPTION_PIN_WORKERS,
+    OPTION_RCVBUF,
+    OPTION_QUEUE_MAXLEN,
+    OPTION_FAIL_OPEN,
+    OPTION_NO_ENOBUFS,
+    OPTION_NO_URING,
+    OPTION_DIRECT_PARSE,
+    OPTION_DBUS_RATE,
 };
 
 static struct option const long_options[] = {
     { "no-syslog", no_argument, NULL, OPTION_NO_SYSLOG },
+    { "sort-threads", required_argument, NULL, OPTION_SORT_THREADS },
+    { "merge-report", required_argument, NULL, OPTION_MERGE_REPORT },
+    { "top-report", required_argument, NULL, OPTION_TOP_REPORT },
+    { "stats-top", required_argument, NULL, OPTION_STATS_TOP },
+    { "stats-file", required_argument, NULL, OPTION_STATS_FILE },
+    { "metrics-socket", required_argument, NULL, OPTION_METRICS_SOCKET },
+    { "stall-ms", required_argument, NULL, OPTION_STALL_MS },
+    { "allow", required_argument, NULL, OPTION_ALLOW },
+    { "pin-workers", no_argument, NULL, OPTION_PIN_WORKERS },
+    { "rcvbuf", required_argument, NULL, OPTION_RCVBUF },
+    { "queue-maxlen", required_argument, NULL, OPTION_QUEUE_MAXLEN },
+    { "fail-open", no_argument, NULL, OPTION_FAIL_OPEN },
+    { "no-enobufs", no_argument, NULL, OPTION_NO_ENOBUFS },
+    { "direct-parse", no_argument, NULL, OPTION_DIRECT_PARSE },
 #ifdef HAVE_DBUS
     { "no-dbus", no_argument, NULL, OPTION_NO_DBUS },
+    { "dbus-rate", required_argument, NULL, OPTION_DBUS_RATE },
+#endif
+#ifdef HAVE_URING
+    { "no-uring", no_argument, NULL, OPTION_NO_URING },
 #endif
     { 0, 0, 0, 0 }
 };
 
+void add_blocklist(const char* name, const char* charset, int list);
+
 void
-add_blocklist_file(const char* name, const char* charset)
+add_blocklist_file(const char* name, const char* charset, int list)
 {
     blocklist_filenames = (char**)realloc(blocklist_filenames, sizeof(const char*) * (blockfile_count + 1));
     CHECK_OOM(blocklist_filenames);
     blocklist_charsets = (const char**)realloc(blocklist_charsets, sizeof(const char*) * (blockfile_count + 1));
     CHECK_OOM(blocklist_charsets);
+    blocklist_lists = (int*)realloc(blocklist_lists, sizeof(int) * (blockfile_count + 1));
+    CHECK_OOM(blocklist_lists);
     blocklist_filenames[blockfile_count] = strdup(name);
     blocklist_charsets[blockfile_count] = charset;
+    blocklist_lists[blockfile_count] = list;
     blockfile_count++;
 }
 
 void
-add_blocklist_dir(const char* name, const char* charset)
+add_allowlist_file(const char* name, const char* charset)
+{
+    allowlist_filenames = (const char**)realloc(allowlist_filenames, sizeof(const char*) * (allowfile_count + 1));
+    CHECK_OOM(allowlist_filenames);
+    allowlist_charsets = (const char**)realloc(allowlist_charsets, sizeof(const char*) * (allowfile_count + 1));
+    CHECK_OOM(allowlist_charsets);
+    allowlist_filenames[allowfile_count] = name;
+    allowlist_charsets[allowfile_count] = charset;
+    allowfile_count++;
+}
+
+#ifndef LOWMEM
+/* Returns the index of the named list, adding it if needed */
+static int
+get_list(const char* name, size_t len)
+{
+    int i;
+    char* copy;
+
+    for (i = 0; i < list_count; i++)
+        if (strlen(lists[i].name) == len && !strncmp(lists[i].name, name, len))
+            return i;
+
+    if (list_count == MAX_LISTS) {
+        fprintf(stderr, "Too many lists, at most %d are supported\n", MAX_LISTS);
+        exit(EXIT_FAILURE);
+    }
+    copy = strndup(name, len);
+    CHECK_OOM(copy);
+    lists[list_count].name = copy;
+    lists[list_count].action = ACTION_DROP;
+    lists[list_count].mark = 0;
+    return list_count++;
+}
+
+/* NAME=FILE */
+static void
+add_named_blocklist(const char* arg, const char* charset)
+{
+    const char* eq = strchr(arg, '=');
+
+    if (!eq || eq == arg) {
+        fprintf(stderr, "Invalid list specification %s, NAME=FILE expected\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    add_blocklist(eq + 1, charset, get_list(arg, eq - arg));
+}
+
+/* NAME=drop, NAME=mark:MARK or NAME=log */
+static void
+set_list_action(const char* arg)
+{
+    const char* eq = strchr(arg, '=');
+    list_group_t* l;
+
+    if (!eq || eq == arg) {
+        fprintf(stderr, "Invalid list action %s, NAME=ACTION expected\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    l = &lists[get_list(arg, eq - arg)];
+    if (!strcmp(eq + 1, "drop")) {
+        l->action = ACTION_DROP;
+    } else if (!strcmp(eq + 1, "log")) {
+        l->action = ACTION_LOG;
+    } else if (!strncmp(eq + 1, "mark:", 5)) {
+        l->action = ACTION_MARK;
+        l->mark = htonl((uint32_t)atoi(eq + 6));
+    } else {
+        fprintf(stderr, "Unknown list action %s\n", eq + 1);
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
+
+void
+add_blocklist_dir(const char* name, const char* charset, int list)
 {
     DIR* dirp;
     struct dirent* dp;
@@ -730,7 +2558,7 @@ add_blocklist_dir(const char* name, const char* charset)
                 exit(EXIT_FAILURE);
             }
             if (sb.st_mode & S_IFREG) {
-                add_blocklist_file(buf, charset);
+                add_blocklist_file(buf, charset, list);
             }
         }
     } while (dp != NULL);
@@ -749,7 +2577,7 @@ add_blocklist_dir(const char* name, const char* charset)
 }
 
 void
-add_blocklist(const char* name, const char* charset)
+add_blocklist(const char* name, const char* charset, int list)
 {
     struct stat sb;
 
@@ -759,9 +2587,9 @@ add_blocklist(const char* name, const char* charset)
     }
 
     if (sb.st_mode & S_IFDIR)
-        add_blocklist_dir(name, charset);
+        add_blocklist_dir(name, charset, list);
     else if (sb.st_mode & S_IFREG)
-        add_blocklist_file(name, charset);
+        add_blocklist_file(name, charset, list);
     else {
         fprintf(stderr, "Unknown blocklist file type for %s\n", name);
         exit(EXIT_FAILURE);
@@ -775,7 +2603,7 @@ main(int argc, char* argv[])
 
     while ((opt = getopt_long(argc, argv, "q:a:r:dbp:f:v"
 #ifndef LOWMEM
-                                          "c:"
+                                          "c:L:A:"
 #endif
                 ,
                 long_options, NULL))
@@ -788,7 +2616,8 @@ main(int argc, char* argv[])
             benchmark = 1;
             break;
         case 'q':
-            queue_num = atoi(optarg);
+            if (sscanf(optarg, "%d-%d", &queue_num, &queue_last) != 2)
+                queue_last = queue_num;
             break;
         case 'r':
             reject_mark = htonl((uint32_t)atoi(optarg));
@@ -803,9 +2632,15 @@ main(int argc, char* argv[])
         case 'c':
             current_charset = optarg;
             break;
+        case 'L':
+            add_named_blocklist(optarg, current_charset);
+            break;
+        case 'A':
+            set_list_action(optarg);
+            break;
 #endif
         case 'f':
-            add_blocklist(optarg, current_charset);
+            add_blocklist(optarg, current_charset, 0);
             break;
         case 'v':
             opt_verbose++;
@@ -813,36 +2648,92 @@ main(int argc, char* argv[])
         case OPTION_NO_SYSLOG:
             use_syslog = 0;
             break;
+        case OPTION_SORT_THREADS:
+            sort_threads = atoi(optarg);
+            break;
+        case OPTION_MERGE_REPORT:
+            merge_report_name = optarg;
+            break;
+        case OPTION_TOP_REPORT:
+            top_report_name = optarg;
+            break;
+        case OPTION_STATS_TOP:
+            stats_top = (unsigned int)atoi(optarg);
+            break;
+        case OPTION_STATS_FILE:
+            stats_file_name = optarg;
+            break;
+        case OPTION_METRICS_SOCKET:
+            metrics_socket_name = optarg;
+            break;
+        case OPTION_STALL_MS:
+            stall_ms = (unsigned int)atoi(optarg);
+            break;
+        case OPTION_ALLOW:
+            add_allowlist_file(optarg, current_charset);
+            break;
+        case OPTION_PIN_WORKERS:
+            pin_workers = 1;
+            break;
+        case OPTION_RCVBUF:
+            rcvbuf_size = (unsigned int)atoi(optarg);
+            break;
+        case OPTION_QUEUE_MAXLEN:
+            queue_maxlen = (unsigned int)atoi(optarg);
+            break;
+        case OPTION_FAIL_OPEN:
+            fail_open = 1;
+            break;
+        case OPTION_NO_ENOBUFS:
+            no_enobufs = 1;
+            break;
+        case OPTION_DIRECT_PARSE:
+            direct_parse = 1;
+            break;
 #ifdef HAVE_DBUS
         case OPTION_NO_DBUS:
             use_dbus = 0;
             break;
+        case OPTION_DBUS_RATE:
+            dbus_rate = (unsigned int)atoi(optarg);
+            break;
+#endif
+#ifdef HAVE_URING
+        case OPTION_NO_URING:
+            use_uring = 0;
+            break;
 #endif
         }
     }
 
-    if (queue_num < 0 || queue_num > 65535) {
+    if (queue_num < 0 || queue_last < queue_num || queue_last > 65535) {
         print_usage();
         exit(EXIT_FAILURE);
     }
 
     for (i = 0; i < argc - optind; i++)
-        add_blocklist(argv[optind + i], current_charset);
+        add_blocklist(argv[optind + i], current_charset, 0);
 
     if (blockfile_count == 0) {
         print_usage();
         exit(EXIT_FAILURE);
     }
 
-    blocklist_init(&blocklist);
+    // the counters of each generation are allocated per worker
+    worker_count = queue_last - queue_num + 1;
+    if (posix_memalign((void**)&workers, CACHE_LINE, sizeof(worker_t) * worker_count) != 0)
+        workers = NULL;
+    CHECK_OOM(workers);
+    memset(workers, 0, sizeof(worker_t) * worker_count);
 
-    if (load_all_lists() < 0) {
+    if (generation_load(&current) < 0) {
         do_log(LOG_ERR, "Cannot load the blocklist");
         return -1;
     }
 
     if (benchmark) {
         do_benchmark();
+        do_parse_benchmark();
         goto out;
     }
 
@@ -875,9 +2766,9 @@ main(int argc, char* argv[])
         return -1;
 
     do_log(LOG_INFO, "Started");
-    do_log(LOG_INFO, "Blocklist has %d entries", blocklist.count);
-    nfqueue_loop();
-    blocklist_stats(&blocklist);
+    do_log(LOG_INFO, "Blocklist has %d entries", current->blocklist.count);
+    run_workers();
+    dump_stats(current, generation_snapshot(current));
 
     if (opt_daemon) {
         closelog();
@@ -890,7 +2781,8 @@ out:
         close_dbus();
 #endif
 
-    blocklist_clear(&blocklist, 0);
+    generation_free(current);
+    free(workers);
     for (i = 0; i < blockfile_count; i++)
         free(blocklist_filenames[i]);
     free(blocklist_filenames);
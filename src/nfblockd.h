@@ -30,6 +30,7 @@
 #include <stdlib.h>
 
 void do_log(int priority, const char* format, ...);
+int do_log_enabled(int priority);
 typedef void (*log_func_t)(int priority, const char* format, ...);
 
 void ip2str(char* dst, uint32_t ip);
@@ -0,0 +1,57 @@
+/*
+   Kernel NFQUEUE statistics
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nfqstat.h"
+
+int
+nfqstat_read(const char* path, int first, int count, nfqstat_t* out)
+{
+    FILE* f;
+    char line[256];
+    int found = 0;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    memset(out, 0, sizeof(nfqstat_t) * count);
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int queue, copy_mode, copy_range;
+        nfqstat_t s;
+
+        // queue portid total copy_mode copy_range dropped user_dropped id 1
+        if (sscanf(line, "%u %u %u %u %u %u %u %u", &queue, &s.portid,
+                &s.queue_total, &copy_mode, &copy_range, &s.queue_dropped,
+                &s.user_dropped, &s.id_sequence) != 8)
+            continue;
+        if (queue < (unsigned int)first || queue - first >= (unsigned int)count)
+            continue;
+        s.valid = 1;
+        out[queue - first] = s;
+        found++;
+    }
+    fclose(f);
+    return found;
+}
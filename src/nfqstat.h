@@ -0,0 +1,51 @@
+/*
+   Kernel NFQUEUE statistics
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef NFQSTAT_H
+#define NFQSTAT_H
+
+#include <inttypes.h>
+
+#define NFQSTAT_PATH "/proc/net/netfilter/nfnetlink_queue"
+
+/* One line of NFQSTAT_PATH, the kernel side of a queue */
+typedef struct nfqstat_t {
+    /* set if the queue was listed */
+    int valid;
+    uint32_t portid;
+    /* packets waiting for a verdict */
+    uint32_t queue_total;
+    /* packets dropped because the queue was full */
+    uint32_t queue_dropped;
+    /* packets that could not be sent to the socket */
+    uint32_t user_dropped;
+    /* id of the last packet queued, counts all the packets */
+    uint32_t id_sequence;
+} nfqstat_t;
+
+/* Reads the counters of the queues first .. first + count - 1 into
+   out, indexed from first. Returns the number of queues found, or -1
+   if the file cannot be read. */
+int nfqstat_read(const char* path, int first, int count, nfqstat_t* out);
+
+#endif
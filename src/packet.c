@@ -0,0 +1,85 @@
+/*
+   Direct parsing of NFQUEUE packet messages
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "packet.h"
+#include <arpa/inet.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include <linux/netlink.h>
+#include <netinet/ip.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Picks the packet header and the IP header from the attributes */
+static int
+parse_message(const struct nlmsghdr* nlh, packet_t* p)
+{
+    const char* attrs = (const char*)nlh + NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+    const char* end = (const char*)nlh + nlh->nlmsg_len;
+    int found = 0;
+
+    while (attrs + NLA_HDRLEN <= end) {
+        const struct nlattr* nla = (const struct nlattr*)attrs;
+        unsigned int len = nla->nla_len;
+
+        if (len < NLA_HDRLEN || attrs + len > end)
+            return -1;
+        switch (nla->nla_type & NLA_TYPE_MASK) {
+        case NFQA_PACKET_HDR: {
+            struct nfqnl_msg_packet_hdr ph;
+            if (len < NLA_HDRLEN + sizeof(ph))
+                return -1;
+            memcpy(&ph, attrs + NLA_HDRLEN, sizeof(ph));
+            p->id = ntohl(ph.packet_id);
+            p->hook = ph.hook;
+            found |= 1;
+            break;
+        }
+        case NFQA_PAYLOAD:
+            if (len < NLA_HDRLEN + sizeof(struct iphdr))
+                return -1;
+            memcpy(&p->saddr, attrs + NLA_HDRLEN + offsetof(struct iphdr, saddr), sizeof(p->saddr));
+            memcpy(&p->daddr, attrs + NLA_HDRLEN + offsetof(struct iphdr, daddr), sizeof(p->daddr));
+            found |= 2;
+            break;
+        }
+        attrs += NLA_ALIGN(len);
+    }
+    return found == 3 ? 1 : -1;
+}
+
+int
+packet_parse(const char* buf, unsigned int len, unsigned int* offset, packet_t* p)
+{
+    while (*offset + NLMSG_HDRLEN <= len) {
+        const struct nlmsghdr* nlh = (const struct nlmsghdr*)(buf + *offset);
+
+        if (nlh->nlmsg_len < NLMSG_HDRLEN || nlh->nlmsg_len > len - *offset) {
+            *offset = len;
+            return -1;
+        }
+        *offset += NLMSG_ALIGN(nlh->nlmsg_len);
+        if (nlh->nlmsg_type == ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET))
+            return parse_message(nlh, p);
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+   Direct parsing of NFQUEUE packet messages
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <inttypes.h>
+
+/* a packet waiting for its verdict */
+typedef struct packet_t {
+    uint32_t id;
+    uint8_t hook;
+    /* network byte order */
+    uint32_t saddr, daddr;
+#ifdef LATENCY_STATS
+    /* latency_now() when received */
+    uint64_t stamp;
+#endif
+} packet_t;
+
+/* Reads the next packet from a buffer of netlink messages received
+   from NFQUEUE, without going through libnetfilter_queue. *offset is
+   the position in buf, start with 0. Returns 1 if a packet was stored
+   to p, -1 if a message could not be parsed and 0 at the end of the
+   buffer. Messages other than packets are skipped. */
+int packet_parse(const char* buf, unsigned int len, unsigned int* offset, packet_t* p);
+
+#endif
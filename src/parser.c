@@ -23,13 +23,34 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <syslog.h>
 
 #include "parser.h"
+#include "probes.h"
 #include "stream.h"
 
+/* iconv is not needed in LOWMEM mode (no strings handled) */
+#ifndef LOWMEM
+#include <iconv.h>
+#else
+typedef int iconv_t;
+static inline iconv_t
+iconv_open(const char* tocode, const char* fromcode)
+{
+    return 0;
+}
+static inline int
+iconv_close(iconv_t cd)
+{
+    return 0;
+}
+#endif
+
 static void
 strip_crlf(char* str)
 {
@@ -42,6 +63,118 @@ strip_crlf(char* str)
     }
 }
 
+/* Label charset conversion. Labels are almost always plain ASCII,
+   which is valid in every supported source charset, so iconv is only
+   called for the rest. UTF-8 input which is already valid is passed
+   through as well. */
+typedef struct conv_t {
+    iconv_t ic;
+    int utf8;
+} conv_t;
+
+static int
+conv_open(conv_t* conv, const char* charset)
+{
+    conv->utf8 = strcasecmp(charset, "UTF-8") == 0 || strcasecmp(charset, "UTF8") == 0;
+    conv->ic = iconv_open("UTF-8", charset);
+    if (conv->ic == (iconv_t)-1) {
+        do_log(LOG_INFO, "Cannot initialize charset conversion: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+conv_close(conv_t* conv)
+{
+    if (conv->ic != (iconv_t)-1)
+        iconv_close(conv->ic);
+    conv->ic = (iconv_t)-1;
+}
+
+#ifndef LOWMEM
+static int
+is_ascii(const char* str)
+{
+    const unsigned char* p = (const unsigned char*)str;
+
+    while (*p) {
+        if (*p & 0x80)
+            return 0;
+        p++;
+    }
+    return 1;
+}
+
+static int
+is_utf8(const char* str)
+{
+    const unsigned char* p = (const unsigned char*)str;
+
+    while (*p) {
+        unsigned int c = *p, n, i;
+        uint32_t cp;
+
+        if (c < 0x80) {
+            p++;
+            continue;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+            cp = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            cp = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return 0;
+        }
+        for (i = 1; i <= n; i++) {
+            if ((p[i] & 0xc0) != 0x80)
+                return 0;
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        /* overlong forms, surrogates and values beyond U+10FFFF */
+        if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+            || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+            return 0;
+        p += n + 1;
+    }
+    return 1;
+}
+
+/* Returns the label converted to UTF-8, either the input itself or
+   the conversion result stored in buf */
+static const char*
+conv_label(conv_t* conv, const char* name, char* buf)
+{
+    size_t insize, outsize;
+    char *inb, *outb;
+
+    if (is_ascii(name) || (conv->utf8 && is_utf8(name)))
+        return name;
+
+    insize = strlen(name);
+    inb = (char*)name;
+    outsize = MAX_LABEL_LENGTH - 1;
+    outb = buf;
+    iconv(conv->ic, NULL, NULL, NULL, NULL);
+    if (iconv(conv->ic, &inb, &insize, &outb, &outsize) == (size_t)-1) {
+        do_log(LOG_ERR, "Cannot convert string: %s", strerror(errno));
+        return "(conversion error)";
+    }
+    *outb = 0;
+    return buf;
+}
+#else
+static const char*
+conv_label(conv_t* conv, const char* name, char* buf)
+{
+    return NULL;
+}
+#endif
+
 static int
 loadlist_dat(blocklist_t* blocklist, const char* filename, const char* charset)
 {
@@ -54,16 +187,14 @@ loadlist_dat(blocklist_t* blocklist, const char* filename, const char* charset)
     int n, dummy;
     int total, ok;
     int ret = -1;
-    iconv_t ic;
+    conv_t conv;
+    char label[MAX_LABEL_LENGTH];
 
-    if (stream_open(&s, filename) < 0) {
-        do_log(LOG_INFO, "Error opening %s.", filename);
+    if (conv_open(&conv, charset) < 0)
         return -1;
-    }
 
-    ic = iconv_open("UTF-8", charset);
-    if (ic == (iconv_t)-1) {
-        do_log(LOG_INFO, "Cannot initialize charset conversion: %s", strerror(errno));
+    if (stream_open(&s, filename) < 0) {
+        do_log(LOG_INFO, "Error opening %s.", filename);
         goto err;
     }
 
@@ -86,7 +217,8 @@ loadlist_dat(blocklist_t* blocklist, const char* filename, const char* charset)
             &dummy, name);
         if (n != 10)
             continue;
-        blocklist_append(blocklist, ntohl(ip1.n), ntohl(ip2.n), name, ic);
+        blocklist_append(blocklist, ntohl(ip1.n), ntohl(ip2.n),
+            conv_label(&conv, name, label));
         ok++;
     }
     stream_close(&s);
@@ -97,8 +229,7 @@ loadlist_dat(blocklist_t* blocklist, const char* filename, const char* charset)
     ret = 0;
 
 err:
-    if (ic)
-        iconv_close(ic);
+    conv_close(&conv);
 
     return ret;
 }
@@ -115,16 +246,14 @@ loadlist_p2p(blocklist_t* blocklist, const char* filename, const char* charset)
     } ip1, ip2;
     int total, ok;
     int ret = -1;
-    iconv_t ic;
+    conv_t conv;
+    char label[MAX_LABEL_LENGTH];
 
-    if (stream_open(&s, filename) < 0) {
-        do_log(LOG_INFO, "Error opening %s.", filename);
+    if (conv_open(&conv, charset) < 0)
         return -1;
-    }
 
-    ic = iconv_open("UTF-8", charset);
-    if (ic == (iconv_t)-1) {
-        do_log(LOG_INFO, "Cannot initialize charset conversion: %s", strerror(errno));
+    if (stream_open(&s, filename) < 0) {
+        do_log(LOG_INFO, "Error opening %s.", filename);
         goto err;
     }
 
@@ -159,7 +288,8 @@ loadlist_p2p(blocklist_t* blocklist, const char* filename, const char* charset)
             continue;
         }
 
-        blocklist_append(blocklist, ntohl(ip1.n), ntohl(ip2.n), name, ic);
+        blocklist_append(blocklist, ntohl(ip1.n), ntohl(ip2.n),
+            conv_label(&conv, name, label));
         ok++;
     }
     stream_close(&s);
@@ -170,8 +300,7 @@ loadlist_p2p(blocklist_t* blocklist, const char* filename, const char* charset)
     ret = 0;
 
 err:
-    if (ic)
-        iconv_close(ic);
+    conv_close(&conv);
 
     return ret;
 }
@@ -207,7 +336,10 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
     char** labels = NULL;
 #endif
     int ret = -1;
-    iconv_t ic = (iconv_t)-1;
+    conv_t conv;
+    char label[MAX_LABEL_LENGTH];
+
+    conv.ic = (iconv_t)-1;
 
     f = fopen(filename, "r");
     if (!f) {
@@ -233,22 +365,19 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
 
     switch (version) {
     case 1:
-        ic = iconv_open("UTF-8", "ISO8859-1");
+        if (conv_open(&conv, "ISO8859-1") < 0)
+            goto err;
         break;
     case 2:
     case 3:
-        ic = iconv_open("UTF-8", "UTF-8");
+        if (conv_open(&conv, "UTF-8") < 0)
+            goto err;
         break;
     default:
         do_log(LOG_INFO, "Unknown P2B version: %d", version);
         goto err;
     }
 
-    if (ic == (iconv_t)-1) {
-        do_log(LOG_INFO, "Cannot initialize charset conversion: %s", strerror(errno));
-        goto err;
-    }
-
     switch (version) {
     case 1:
     case 2:
@@ -271,7 +400,8 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
                 do_log(LOG_ERR, "P2B: Error reading range end");
                 break;
             }
-            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2), buf, ic);
+            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2),
+                conv_label(&conv, buf, label));
         }
         break;
     case 3:
@@ -297,7 +427,9 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
                 goto err;
             }
 #ifndef LOWMEM
-            labels[i] = strdup(buf);
+            /* convert the label table once, the ranges refer to it */
+            labels[i] = strdup(conv_label(&conv, buf, label));
+            CHECK_OOM(labels[i]);
 #endif
         }
 
@@ -307,7 +439,7 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
         cnt = ntohl(cnt);
         for (i = 0; i < cnt; i++) {
             nread = fread(&idx, 1, 4, f);
-            if (nread != 4 || ntohl(idx) > nlabels) {
+            if (nread != 4 || ntohl(idx) >= nlabels) {
                 do_log(LOG_ERR, "P2B3: Error reading label index");
                 goto err;
             }
@@ -322,9 +454,9 @@ loadlist_p2b(blocklist_t* blocklist, const char* filename)
                 goto err;
             }
 #ifndef LOWMEM
-            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2), labels[ntohl(idx)], ic);
+            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2), labels[ntohl(idx)]);
 #else
-            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2), NULL, ic);
+            blocklist_append(blocklist, ntohl(ip1), ntohl(ip2), NULL);
 #endif
         }
         break;
@@ -342,8 +474,7 @@ err:
     }
 #endif
     fclose(f);
-    if (ic)
-        iconv_close(ic);
+    conv_close(&conv);
     return ret;
 }
 
@@ -352,26 +483,102 @@ load_list(blocklist_t* blocklist, const char* filename, const char* charset)
 {
     int prevcount;
 
+    PROBE1(load_start, filename);
     prevcount = blocklist->count;
     if (loadlist_p2b(blocklist, filename) == 0) {
         do_log(LOG_DEBUG, "PeerGuardian Binary: %d entries loaded", blocklist->count - prevcount);
+        PROBE3(load_done, filename, "p2b", blocklist->count - prevcount);
         return 0;
     }
-    blocklist_clear(blocklist, prevcount);
+    blocklist_truncate(blocklist, prevcount);
 
     prevcount = blocklist->count;
     if (loadlist_dat(blocklist, filename, charset ? charset : "ISO8859-1") == 0) {
         do_log(LOG_DEBUG, "IPFilter: %d entries loaded", blocklist->count - prevcount);
+        PROBE3(load_done, filename, "dat", blocklist->count - prevcount);
         return 0;
     }
-    blocklist_clear(blocklist, prevcount);
+    blocklist_truncate(blocklist, prevcount);
 
     prevcount = blocklist->count;
     if (loadlist_p2p(blocklist, filename, charset ? charset : "ISO8859-1") == 0) {
         do_log(LOG_DEBUG, "PeerGuardian Ascii: %d entries loaded", blocklist->count - prevcount);
+        PROBE3(load_done, filename, "p2p", blocklist->count - prevcount);
         return 0;
     }
-    blocklist_clear(blocklist, prevcount);
+    blocklist_truncate(blocklist, prevcount);
 
+    PROBE3(load_done, filename, "none", -1);
     return -1;
 }
+
+/* Cheap estimate of the number of entries in a file, used to size
+   the blocklist memory before the file is parsed. The counts read
+   from the file are capped by what the file can actually hold. */
+unsigned int
+estimate_list(const char* filename)
+{
+    FILE* f;
+    struct stat sb;
+    uint8_t header[8];
+    uint64_t count = 0;
+    int l = strlen(filename);
+
+    f = fopen(filename, "r");
+    if (!f)
+        return 0;
+    if (fstat(fileno(f), &sb) < 0)
+        goto out;
+
+    if (l >= 3 && strcmp(filename + l - 3, ".gz") == 0) {
+        /* the gzip trailer holds the uncompressed size modulo 2^32 */
+        uint8_t isize[4];
+        if (sb.st_size >= 4 && fseek(f, -4, SEEK_END) == 0
+            && fread(isize, 1, 4, f) == 4) {
+            count = (uint32_t)isize[0] | (uint32_t)isize[1] << 8
+                | (uint32_t)isize[2] << 16 | (uint32_t)isize[3] << 24;
+            /* deflate does not compress better than 1032:1 */
+            if (count > (uint64_t)sb.st_size * 1032)
+                count = (uint64_t)sb.st_size * 1032;
+            count /= 32;
+        }
+    } else if (fread(header, 1, 8, f) == 8
+        && memcmp(header, "\xff\xff\xff\xffP2B", 7) == 0) {
+        if (header[7] == 3) {
+            char buf[MAX_LABEL_LENGTH];
+            uint32_t cnt, i;
+            if (fread(&cnt, 1, 4, f) != 4)
+                goto out;
+            cnt = ntohl(cnt);
+            for (i = 0; i < cnt; i++)
+                if (read_cstr(buf, MAX_LABEL_LENGTH, f) < 0)
+                    goto out;
+            if (fread(&cnt, 1, 4, f) == 4) {
+                /* a range takes a label index and two addresses */
+                long pos = ftell(f);
+                count = ntohl(cnt);
+                if (pos >= 0 && count > (uint64_t)(sb.st_size - pos) / 12)
+                    count = (uint64_t)(sb.st_size - pos) / 12;
+            }
+        } else {
+            /* a label is at least one byte */
+            count = sb.st_size / 9;
+        }
+    } else {
+        char buf[65536];
+        size_t n;
+        rewind(f);
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            char *p = buf, *end = buf + n;
+            while ((p = memchr(p, '\n', end - p)) != NULL) {
+                count++;
+                p++;
+            }
+        }
+        count++;
+    }
+
+out:
+    fclose(f);
+    return count > UINT_MAX / 2 ? UINT_MAX / 2 : count;
+}
@@ -28,5 +28,6 @@
 #include "nfblockd.h"
 
 int load_list(blocklist_t* blocklist, const char* filename, const char* charset);
+unsigned int estimate_list(const char* filename);
 
 #endif
@@ -0,0 +1,53 @@
+/*
+   USDT probes
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes of the nfblockd provider. With USDT=yes each probe is a
+   single nop in the code plus a note in the ELF file, which tools like
+   bpftrace or perf attach to at run time, e.g.
+
+   bpftrace -e 'usdt:/usr/sbin/nfblockd:nfblockd:load_done
+       { printf("%s %s %d\n", str(arg0), str(arg1), arg2); }'
+
+   Otherwise the probes compile to nothing. The arguments must not
+   have side effects. */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(nfblockd, name)
+#define PROBE1(name, a) DTRACE_PROBE1(nfblockd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(nfblockd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(nfblockd, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(nfblockd, name, a, b, c, d)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+/*
+   Range set operations
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "rangeset.h"
+
+static inline unsigned int
+range_emit(block_entry_t* out, unsigned int* origin, unsigned int n,
+    uint32_t ip_min, uint32_t ip_max, unsigned int idx)
+{
+    out[n].ip_min = ip_min;
+    out[n].ip_max = ip_max;
+    if (origin)
+        origin[n] = idx;
+    return n + 1;
+}
+
+unsigned int
+range_union(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out)
+{
+    unsigned int i = 0, j = 0, n = 0;
+
+    while (i < na || j < nb) {
+        const block_entry_t* r;
+
+        if (j == nb || (i < na && a[i].ip_min <= b[j].ip_min))
+            r = &a[i++];
+        else
+            r = &b[j++];
+
+        /* merge with the previous range if they overlap or touch */
+        if (n > 0 && (out[n - 1].ip_max == UINT32_MAX || r->ip_min <= out[n - 1].ip_max + 1)) {
+            if (r->ip_max > out[n - 1].ip_max)
+                out[n - 1].ip_max = r->ip_max;
+        } else {
+            out[n++] = *r;
+        }
+    }
+    return n;
+}
+
+unsigned int
+range_intersect(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out, unsigned int* origin)
+{
+    unsigned int i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        uint32_t lo = a[i].ip_min > b[j].ip_min ? a[i].ip_min : b[j].ip_min;
+        uint32_t hi = a[i].ip_max < b[j].ip_max ? a[i].ip_max : b[j].ip_max;
+
+        if (lo <= hi)
+            n = range_emit(out, origin, n, lo, hi, i);
+        /* advance the range which ends first */
+        if (a[i].ip_max < b[j].ip_max)
+            i++;
+        else
+            j++;
+    }
+    return n;
+}
+
+unsigned int
+range_subtract(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out, unsigned int* origin)
+{
+    unsigned int i, j = 0, k, n = 0;
+
+    for (i = 0; i < na; i++) {
+        uint32_t lo = a[i].ip_min, hi = a[i].ip_max;
+        int covered = 0;
+
+        /* skip the holes below this range */
+        while (j < nb && b[j].ip_max < lo)
+            j++;
+
+        /* a hole can extend into the next range, so j stays put */
+        for (k = j; k < nb && b[k].ip_min <= hi; k++) {
+            if (b[k].ip_min > lo)
+                n = range_emit(out, origin, n, lo, b[k].ip_min - 1, i);
+            if (b[k].ip_max >= hi) {
+                covered = 1;
+                break;
+            }
+            lo = b[k].ip_max + 1;
+        }
+        if (!covered)
+            n = range_emit(out, origin, n, lo, hi, i);
+    }
+    return n;
+}
@@ -0,0 +1,46 @@
+/*
+   Range set operations
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef RANGESET_H
+#define RANGESET_H
+
+#include "blocklist.h"
+
+/* Set operations on arrays of ranges, as left by blocklist_sort()
+   and blocklist_trim(): sorted and without overlapping or adjacent
+   ranges. The output has the same properties and must have room for
+   na + nb ranges. If origin is not NULL, it receives the index of
+   the range of a each output range was taken from. All functions
+   return the number of output ranges. */
+
+unsigned int range_union(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out);
+unsigned int range_intersect(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out, unsigned int* origin);
+unsigned int range_subtract(const block_entry_t* a, unsigned int na,
+    const block_entry_t* b, unsigned int nb,
+    block_entry_t* out, unsigned int* origin);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+   Bounded lock-free multi-producer ring
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "ring.h"
+#include <stdlib.h>
+
+typedef struct ring_cell_t {
+    uint64_t seq;
+    /* position the producer claimed the cell for */
+    uint64_t pos;
+} ring_cell_t;
+
+#define CELL(r, pos) ((ring_cell_t*)((r)->cells + ((pos) & ((r)->size - 1)) * (r)->cell_size))
+
+int
+ring_init(ring_t* r, unsigned int size, unsigned int record_size)
+{
+    uint64_t i;
+
+    r->size = size;
+    r->cell_size = (sizeof(ring_cell_t) + record_size + 7) & ~7u;
+    r->cells = malloc((size_t)size * r->cell_size);
+    if (!r->cells)
+        return -1;
+    for (i = 0; i < size; i++)
+        CELL(r, i)->seq = i;
+    r->enqueue_pos = r->dequeue_pos = 0;
+    r->dropped = 0;
+    return 0;
+}
+
+void
+ring_free(ring_t* r)
+{
+    free(r->cells);
+    r->cells = NULL;
+}
+
+void*
+ring_reserve(ring_t* r)
+{
+    uint64_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    ring_cell_t* c;
+
+    for (;;) {
+        int64_t diff;
+
+        c = CELL(r, pos);
+        diff = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // the consumer has not freed this cell yet
+            __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    c->pos = pos;
+    return c + 1;
+}
+
+void
+ring_commit(ring_t* r, void* record)
+{
+    ring_cell_t* c = (ring_cell_t*)record - 1;
+
+    __atomic_store_n(&c->seq, c->pos + 1, __ATOMIC_RELEASE);
+}
+
+void*
+ring_peek(ring_t* r)
+{
+    ring_cell_t* c = CELL(r, r->dequeue_pos);
+
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != r->dequeue_pos + 1)
+        return NULL;
+    return c + 1;
+}
+
+void
+ring_consume(ring_t* r)
+{
+    ring_cell_t* c = CELL(r, r->dequeue_pos);
+
+    __atomic_store_n(&c->seq, r->dequeue_pos + r->size, __ATOMIC_RELEASE);
+    r->dequeue_pos++;
+}
@@ -0,0 +1,55 @@
+/*
+   Bounded lock-free multi-producer ring
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <inttypes.h>
+
+/* A bounded queue of fixed-size records for any number of producers
+   and a single consumer (D. Vyukov's design). Each record carries a
+   sequence number telling whether it is free for the producer at its
+   position, or filled for the consumer. Neither side ever blocks. */
+typedef struct ring_t {
+    char* cells;
+    unsigned int size, cell_size;
+    /* the producers' and the consumer's positions, kept apart */
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+    uint64_t dropped;
+} ring_t;
+
+/* size must be a power of 2 */
+int ring_init(ring_t* r, unsigned int size, unsigned int record_size);
+void ring_free(ring_t* r);
+/* Claims a record to fill, NULL if the ring is full; that counts as
+   a dropped record */
+void* ring_reserve(ring_t* r);
+/* Hands a filled record over to the consumer */
+void ring_commit(ring_t* r, void* record);
+/* The oldest committed record, NULL if there is none */
+void* ring_peek(ring_t* r);
+/* Frees the record returned by ring_peek() */
+void ring_consume(ring_t* r);
+
+#endif
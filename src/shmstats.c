@@ -0,0 +1,116 @@
+/*
+   Statistics shared through a memory mapped file
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shmstats.h"
+
+/* Creates the directory of path if missing, e.g. /run/nfblockd */
+static void
+create_parent(const char* path)
+{
+    char dir[PATH_MAX];
+    char* slash;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash || slash == dir)
+        return;
+    *slash = 0;
+    mkdir(dir, 0755);
+}
+
+shmstats_t*
+shmstats_create(const char* path, unsigned int range_count)
+{
+    char tmp[PATH_MAX];
+    size_t size = sizeof(shmstats_t) + sizeof(shmstats_range_t) * range_count;
+    shmstats_t* s = MAP_FAILED;
+    int fd, err;
+
+    create_parent(path);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) < 0)
+        goto err;
+    s = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED)
+        goto err;
+
+    // the file is zeroed by ftruncate, the readers wait until the
+    // caller fills it in
+    s->seq = 1;
+    s->magic = SHMSTATS_MAGIC;
+    s->version = SHMSTATS_VERSION;
+    s->size = size;
+    s->pid = getpid();
+    s->range_count = range_count;
+    if (rename(tmp, path) < 0)
+        goto err;
+    close(fd);
+    return s;
+
+err:
+    err = errno;
+    if (s != MAP_FAILED)
+        munmap(s, size);
+    close(fd);
+    unlink(tmp);
+    errno = err;
+    return NULL;
+}
+
+void
+shmstats_close(shmstats_t* s, const char* path, int remove)
+{
+    if (remove)
+        unlink(path);
+    __atomic_store_n(&s->superseded, 1, __ATOMIC_RELEASE);
+    munmap(s, s->size);
+}
+
+void
+shmstats_begin(shmstats_t* s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    // the seq change is visible before any of the data
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+shmstats_end(shmstats_t* s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,100 @@
+/*
+   Statistics shared through a memory mapped file
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <inttypes.h>
+
+/* "NFST" */
+#define SHMSTATS_MAGIC 0x4e465354
+/* changed whenever the layout below changes */
+#define SHMSTATS_VERSION 1
+
+enum {
+    SHMSTATS_IN,
+    SHMSTATS_OUT,
+    SHMSTATS_FWD,
+    SHMSTATS_OTHER,
+    SHMSTATS_HOOKS
+};
+
+/* in the order of list_action_t */
+enum {
+    SHMSTATS_DROP,
+    SHMSTATS_MARK,
+    SHMSTATS_LOG,
+    SHMSTATS_ACCEPT,
+    SHMSTATS_VERDICTS
+};
+
+typedef struct shmstats_range_t {
+    /* host order */
+    uint32_t ip_min, ip_max;
+    uint64_t hits;
+} shmstats_range_t;
+
+/* Written by the daemon only. The readers copy it while seq is even
+   and unchanged, like a seqlock. */
+typedef struct shmstats_t {
+    uint32_t magic;
+    uint32_t version;
+    /* of the whole file */
+    uint64_t size;
+    /* odd while being updated */
+    uint64_t seq;
+    /* set once the file has been replaced or removed, the path has to
+       be opened again */
+    uint32_t superseded;
+    uint32_t pid;
+    /* time of the last update */
+    int64_t updated;
+
+    /* blocklist loads since the start, the time and the duration of
+       the last one */
+    uint64_t generation;
+    int64_t loaded;
+    uint64_t load_usec;
+
+    uint64_t packets[SHMSTATS_HOOKS];
+    uint64_t verdicts[SHMSTATS_VERDICTS];
+    uint64_t errors, overruns, log_dropped;
+    uint64_t hits;
+
+    uint32_t range_count;
+    uint32_t reserved;
+    shmstats_range_t ranges[];
+} shmstats_t;
+
+/* Creates the file with room for range_count ranges and maps it. The
+   file is created next to path and renamed over it. It is returned in
+   the middle of an update, to be finished by shmstats_end() once
+   filled in. Returns NULL on error. */
+shmstats_t* shmstats_create(const char* path, unsigned int range_count);
+/* Marks the file as superseded and unmaps it, removing it if remove
+   is set */
+void shmstats_close(shmstats_t* s, const char* path, int remove);
+void shmstats_begin(shmstats_t* s);
+void shmstats_end(shmstats_t* s);
+
+#endif
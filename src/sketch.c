@@ -0,0 +1,234 @@
+/*
+   Heavy-hitter sketch of the blocked addresses
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+/* Multiply-shift hashing, one odd multiplier per row. All the sketches
+   use the same ones, so that they can be summed up. */
+static const uint64_t seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ull,
+    0xc2b2ae3d27d4eb4full,
+    0x165667b19e3779f9ull,
+    0xd6e8feb86659fd93ull,
+};
+
+#define HASH(row, addr) \
+    ((unsigned int)(((uint64_t)(addr) * seeds[row]) >> (64 - SKETCH_BITS)))
+#define SLOT(addr) (((uint32_t)(addr) * 0x9e3779b1u) >> (32 - SKETCH_SLOT_BITS))
+#define NEXT_SLOT(i) (((i) + 1) & (SKETCH_SLOTS - 1))
+
+static int
+index_find(const sketch_t* s, uint32_t addr)
+{
+    unsigned int i;
+
+    for (i = SLOT(addr); s->index[i]; i = NEXT_SLOT(i)) {
+        if (s->top[s->index[i] - 1].addr == addr)
+            return s->index[i] - 1;
+    }
+    return -1;
+}
+
+static unsigned int
+index_claim(const sketch_t* s, uint32_t addr)
+{
+    unsigned int i;
+
+    for (i = SLOT(addr); s->index[i]; i = NEXT_SLOT(i))
+        ;
+    return i;
+}
+
+/* Empties a slot, moving back the following entries of the cluster
+   which would not be found past the hole otherwise */
+static void
+index_remove(sketch_t* s, unsigned int hole)
+{
+    unsigned int i, home;
+
+    for (i = NEXT_SLOT(hole); s->index[i]; i = NEXT_SLOT(i)) {
+        sketch_item_t* item = &s->top[s->index[i] - 1];
+        home = SLOT(item->addr);
+        if (((i - home) & (SKETCH_SLOTS - 1)) >= ((i - hole) & (SKETCH_SLOTS - 1))) {
+            s->index[hole] = s->index[i];
+            item->slot = hole;
+            hole = i;
+        }
+    }
+    s->index[hole] = 0;
+}
+
+static void
+heap_set(sketch_t* s, unsigned int pos, const sketch_item_t* item)
+{
+    // the address is read by sketch_top()
+    __atomic_store_n(&s->top[pos].addr, item->addr, __ATOMIC_RELAXED);
+    s->top[pos].slot = item->slot;
+    s->top[pos].count = item->count;
+    s->index[item->slot] = pos + 1;
+}
+
+static void
+sift_down(sketch_t* s, unsigned int pos)
+{
+    sketch_item_t item = s->top[pos];
+    unsigned int child;
+
+    while ((child = 2 * pos + 1) < s->ntop) {
+        if (child + 1 < s->ntop && s->top[child + 1].count < s->top[child].count)
+            child++;
+        if (s->top[child].count >= item.count)
+            break;
+        heap_set(s, pos, &s->top[child]);
+        pos = child;
+    }
+    heap_set(s, pos, &item);
+}
+
+static void
+sift_up(sketch_t* s, unsigned int pos)
+{
+    sketch_item_t item = s->top[pos];
+    unsigned int parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (s->top[parent].count <= item.count)
+            break;
+        heap_set(s, pos, &s->top[parent]);
+        pos = parent;
+    }
+    heap_set(s, pos, &item);
+}
+
+/* Updates the Count-Min rows and keeps the addresses with the highest
+   estimates in the heap. Like in Space-Saving, a new address replaces
+   the lightest one, but only once its estimate exceeds it, so a flood
+   of single hits does not churn the heap. */
+void
+sketch_add(sketch_t* s, uint32_t addr)
+{
+    uint64_t estimate = UINT64_MAX;
+    sketch_item_t item;
+    unsigned int row;
+    int pos;
+
+    for (row = 0; row < SKETCH_DEPTH; row++) {
+        uint64_t* c = &s->counts[row][HASH(row, addr)];
+        uint64_t v = *c + 1;
+        __atomic_store_n(c, v, __ATOMIC_RELAXED);
+        if (v < estimate)
+            estimate = v;
+    }
+
+    pos = index_find(s, addr);
+    if (pos >= 0) {
+        // estimates only grow
+        s->top[pos].count = estimate;
+        sift_down(s, pos);
+        return;
+    }
+
+    item.addr = addr;
+    item.count = estimate;
+    if (s->ntop < SKETCH_TOP) {
+        item.slot = index_claim(s, addr);
+        heap_set(s, s->ntop, &item);
+        __atomic_store_n(&s->ntop, s->ntop + 1, __ATOMIC_RELAXED);
+        sift_up(s, s->ntop - 1);
+    } else if (estimate > s->top[0].count) {
+        index_remove(s, s->top[0].slot);
+        item.slot = index_claim(s, addr);
+        heap_set(s, 0, &item);
+        sift_down(s, 0);
+    }
+}
+
+static int
+compare_addr(const void* p1, const void* p2)
+{
+    uint32_t a1 = ((const sketch_result_t*)p1)->addr;
+    uint32_t a2 = ((const sketch_result_t*)p2)->addr;
+
+    return a1 < a2 ? -1 : a1 > a2;
+}
+
+static int
+compare_count(const void* p1, const void* p2)
+{
+    uint64_t c1 = ((const sketch_result_t*)p1)->count;
+    uint64_t c2 = ((const sketch_result_t*)p2)->count;
+
+    return c1 > c2 ? -1 : c1 < c2;
+}
+
+/* The candidates are the addresses in the heaps of all the sketches,
+   estimated from the sum of their rows, as if the hits had been
+   counted in a single sketch */
+unsigned int
+sketch_top(sketch_t* const* sketches, unsigned int n,
+    sketch_result_t* out, unsigned int max)
+{
+    sketch_result_t* cand;
+    unsigned int i, j, k, count = 0, unique = 0;
+
+    cand = malloc(sizeof(sketch_result_t) * SKETCH_TOP * (n ? n : 1));
+    if (!cand)
+        return 0;
+    for (i = 0; i < n; i++) {
+        unsigned int ntop = __atomic_load_n(&sketches[i]->ntop, __ATOMIC_RELAXED);
+        for (j = 0; j < ntop; j++)
+            cand[count++].addr = __atomic_load_n(&sketches[i]->top[j].addr, __ATOMIC_RELAXED);
+    }
+
+    qsort(cand, count, sizeof(sketch_result_t), compare_addr);
+    for (i = 0; i < count; i++) {
+        uint32_t addr = cand[i].addr;
+        uint64_t estimate = UINT64_MAX;
+        unsigned int row;
+
+        if (unique > 0 && cand[unique - 1].addr == addr)
+            continue;
+        for (row = 0; row < SKETCH_DEPTH; row++) {
+            uint64_t sum = 0;
+            for (k = 0; k < n; k++)
+                sum += __atomic_load_n(&sketches[k]->counts[row][HASH(row, addr)],
+                    __ATOMIC_RELAXED);
+            if (sum < estimate)
+                estimate = sum;
+        }
+        cand[unique].addr = addr;
+        cand[unique].count = estimate;
+        unique++;
+    }
+
+    qsort(cand, unique, sizeof(sketch_result_t), compare_count);
+    if (unique > max)
+        unique = max;
+    memcpy(out, cand, sizeof(sketch_result_t) * unique);
+    free(cand);
+    return unique;
+}
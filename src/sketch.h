@@ -0,0 +1,76 @@
+/*
+   Heavy-hitter sketch of the blocked addresses
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <inttypes.h>
+
+/* Count-Min sketch rows, and the log2 of their width. Each counter
+   overestimates an address by about e / width of all the hits. */
+#define SKETCH_DEPTH 4
+#ifndef LOWMEM
+#define SKETCH_BITS 10
+#else
+#define SKETCH_BITS 8
+#endif
+#define SKETCH_WIDTH (1 << SKETCH_BITS)
+/* heaviest addresses kept */
+#define SKETCH_TOP 32
+/* log2 of the index size, at least twice SKETCH_TOP */
+#define SKETCH_SLOT_BITS 6
+#define SKETCH_SLOTS (1 << SKETCH_SLOT_BITS)
+
+typedef struct sketch_item_t {
+    uint32_t addr;
+    /* position in the index */
+    uint32_t slot;
+    uint64_t count;
+} sketch_item_t;
+
+/* Empty when zeroed. Updated by a single thread with relaxed stores,
+   the counters and the addresses can be read by others meanwhile, see
+   sketch_top(). */
+typedef struct sketch_t {
+    uint64_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    /* min-heap of the heaviest addresses by their estimate */
+    sketch_item_t top[SKETCH_TOP];
+    unsigned int ntop;
+    /* open addressing index of the heap, position + 1 or 0 */
+    uint8_t index[SKETCH_SLOTS];
+} sketch_t;
+
+typedef struct sketch_result_t {
+    uint32_t addr;
+    uint64_t count;
+} sketch_result_t;
+
+/* Counts a hit of addr, which is kept as is, e.g. in network order */
+void sketch_add(sketch_t* s, uint32_t addr);
+/* Merges n sketches of the same stream and stores at most max of the
+   heaviest addresses in out, sorted by their summed estimate. Can run
+   while the sketches are updated, the result is approximate anyway. */
+unsigned int sketch_top(sketch_t* const* sketches, unsigned int n,
+    sketch_result_t* out, unsigned int max);
+
+#endif
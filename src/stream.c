@@ -24,14 +24,105 @@
 #include "stream.h"
 #include "nfblockd.h"
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 
 #ifdef HAVE_ZLIB
+
+/* Inflating thread. Fills the free buffers of the ring and hands them
+   over to the reader until the end of the stream is reached. */
+static void*
+stream_inflate(void* arg)
+{
+    stream_t* stream = arg;
+    unsigned char* in;
+    int ret, done = 0;
+
+    in = malloc(CHUNK);
+    if (!in) {
+        do_log(LOG_ERR, "Out of memory during decompression");
+        done = 1;
+    }
+
+    while (!done) {
+        stream_buffer_t* b;
+
+        pthread_mutex_lock(&stream->lock);
+        while (stream->filled == STREAM_BUFFERS && !stream->cancel)
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        if (stream->cancel) {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        b = &stream->buffers[(stream->head + stream->filled) % STREAM_BUFFERS];
+        pthread_mutex_unlock(&stream->lock);
+
+        stream->strm.next_out = b->data;
+        stream->strm.avail_out = STREAM_BUFSIZE;
+        do {
+            if (stream->strm.avail_in == 0) {
+                stream->strm.avail_in = fread(in, 1, CHUNK, stream->f);
+                if (stream->strm.avail_in == 0) {
+                    if (ferror(stream->f))
+                        do_log(LOG_INFO, "Error reading file");
+                    done = 1;
+                    break;
+                }
+                stream->strm.next_in = in;
+            }
+
+            ret = inflate(&stream->strm, Z_NO_FLUSH);
+            switch (ret) {
+            case Z_STREAM_END:
+                done = 1;
+                break;
+            case Z_NEED_DICT:
+            case Z_DATA_ERROR:
+            case Z_MEM_ERROR:
+                do_log(LOG_INFO, "Error during decompression");
+                done = 1;
+                break;
+            default:
+                break;
+            }
+        } while (!done && stream->strm.avail_out);
+        b->len = STREAM_BUFSIZE - stream->strm.avail_out;
+
+        if (b->len) {
+            pthread_mutex_lock(&stream->lock);
+            stream->filled++;
+            pthread_cond_signal(&stream->cond);
+            pthread_mutex_unlock(&stream->lock);
+        }
+    }
+
+    inflateEnd(&stream->strm);
+    free(in);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->eos = 1;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+static void
+stream_free_buffers(stream_t* stream)
+{
+    int i;
+
+    for (i = 0; i < STREAM_BUFFERS; i++) {
+        free(stream->buffers[i].data);
+        stream->buffers[i].data = NULL;
+    }
+}
+
 int
 stream_open(stream_t* stream, const char* filename)
 {
-    int l = strlen(filename);
+    int i, l = strlen(filename);
     if (l >= 3 && strcmp(filename + l - 3, ".gz") == 0) {
         stream->f = fopen(filename, "r");
         if (!stream->f) {
@@ -47,11 +138,28 @@ stream_open(stream_t* stream, const char* filename)
         stream->strm.next_in = Z_NULL;
         if (inflateInit2(&stream->strm, 47) != Z_OK) {
             do_log(LOG_INFO, "Cannot initialize zLib");
+            fclose(stream->f);
+            return -1;
+        }
+
+        for (i = 0; i < STREAM_BUFFERS; i++) {
+            stream->buffers[i].data = malloc(STREAM_BUFSIZE);
+            stream->buffers[i].len = 0;
+            CHECK_OOM(stream->buffers[i].data);
+        }
+        stream->head = stream->filled = stream->pos = 0;
+        stream->eos = stream->cancel = 0;
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->cond, NULL);
+        if (pthread_create(&stream->thread, NULL, stream_inflate, stream) != 0) {
+            do_log(LOG_INFO, "Cannot start the decompression thread");
+            inflateEnd(&stream->strm);
+            pthread_cond_destroy(&stream->cond);
+            pthread_mutex_destroy(&stream->lock);
+            stream_free_buffers(stream);
+            fclose(stream->f);
             return -1;
         }
-        stream->strm.avail_out = CHUNK;
-        stream->strm.next_out = stream->out;
-        stream->eos = 0;
     } else {
         stream->compressed = 0;
         stream->f = fopen(filename, "r");
@@ -68,87 +176,86 @@ int
 stream_close(stream_t* stream)
 {
     if (stream->compressed) {
-        if (!stream->eos) {
-            inflateEnd(&stream->strm);
-        }
-        if (fclose(stream->f) < 0) {
-            do_log(LOG_INFO, "Error closing file: %s", strerror(errno));
-            return -1;
-        }
-    } else {
-        if (fclose(stream->f) < 0) {
-            do_log(LOG_INFO, "Error closing file: %s", strerror(errno));
-            return -1;
-        }
+        pthread_mutex_lock(&stream->lock);
+        stream->cancel = 1;
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->thread, NULL);
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->lock);
+        stream_free_buffers(stream);
+    }
+    if (fclose(stream->f) < 0) {
+        do_log(LOG_INFO, "Error closing file: %s", strerror(errno));
+        return -1;
     }
     return 0;
 }
 
+/* Returns the buffer at the head of the ring, waiting for the
+   inflating thread if necessary. NULL means end of stream. */
+static stream_buffer_t*
+stream_head(stream_t* stream)
+{
+    stream_buffer_t* b = NULL;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->filled == 0 && !stream->eos)
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    if (stream->filled)
+        b = &stream->buffers[stream->head];
+    pthread_mutex_unlock(&stream->lock);
+    return b;
+}
+
+/* Gives the fully consumed head buffer back to the inflating thread */
+static void
+stream_release(stream_t* stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->head = (stream->head + 1) % STREAM_BUFFERS;
+    stream->filled--;
+    stream->pos = 0;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+}
+
 char*
 stream_getline(char* buf, int max, stream_t* stream)
 {
     if (stream->compressed) {
-        int ret, avail;
-        unsigned char* ptr;
-        if (!stream->eos && stream->strm.avail_out) {
-            do {
-                if (stream->strm.avail_in == 0) {
-                    stream->strm.avail_in = fread(stream->in, 1,
-                        CHUNK, stream->f);
-                    if (stream->strm.avail_in == 0) {
-                        if (ferror(stream->f))
-                            do_log(LOG_INFO, "Error reading file");
-                        stream->eos = 1;
-                        inflateEnd(&stream->strm);
-                        break;
-                    }
-                    stream->strm.next_in = stream->in;
-                }
+        int copied = 0;
 
-                ret = inflate(&stream->strm, Z_NO_FLUSH);
-                switch (ret) {
-                case Z_STREAM_END:
-                    stream->eos = 1;
-                    inflateEnd(&stream->strm);
-                    goto out;
-                case Z_NEED_DICT:
-                    ret = Z_DATA_ERROR; /* and fall through */
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    do_log(LOG_INFO, "Error during decompression");
-                    stream->eos = 1;
-                    inflateEnd(&stream->strm);
-                    goto out;
-                default:
-                    break;
-                }
-            } while (stream->strm.avail_out);
-        }
+        while (copied < max - 1) {
+            stream_buffer_t* b;
+            unsigned char *start, *ptr;
+            int avail;
 
-    out:
-
-        avail = CHUNK - stream->strm.avail_out;
-        ptr = memchr(stream->out, '\n', avail);
-        // handle lines is longer than the maximum
-        if (!ptr && avail > max - 1)
-            ptr = stream->out + max - 1;
-        // handle missing LF at the end of file
-        if (!ptr && avail && stream->eos)
-            ptr = stream->out + avail - 1;
-        // now, ptr should point to the last character copied, if there is any
-        if (ptr) {
-            int copied = ptr - stream->out + 1;
-            if (copied >= max - 1)
-                copied = max - 1;
-            memcpy(buf, stream->out, copied);
-            buf[copied] = 0;
-
-            memmove(stream->out, stream->out + copied, avail - copied);
-            stream->strm.avail_out += copied;
-            stream->strm.next_out -= copied;
-            return buf;
+            b = stream_head(stream);
+            if (!b)
+                break;
+
+            start = b->data + stream->pos;
+            avail = b->len - stream->pos;
+            if (avail > max - 1 - copied)
+                avail = max - 1 - copied;
+            ptr = memchr(start, '\n', avail);
+            if (ptr)
+                avail = ptr - start + 1;
+
+            memcpy(buf + copied, start, avail);
+            copied += avail;
+            stream->pos += avail;
+            if (stream->pos == b->len)
+                stream_release(stream);
+            if (ptr)
+                break;
         }
-        return NULL;
+
+        if (copied == 0)
+            return NULL;
+        buf[copied] = 0;
+        return buf;
     } else {
         char* ret;
         ret = fgets(buf, max, stream->f);
@@ -27,19 +27,43 @@
 #include <stdio.h>
 
 #ifdef HAVE_ZLIB
+#include <pthread.h>
 #include <zlib.h>
 #endif
 
-#define CHUNK 1024
+#define CHUNK 65536
+
+/* Compressed files are inflated by a separate thread into a small
+   ring of buffers, so the decompression overlaps with the parsing.
+   The memory used is bounded by STREAM_BUFFERS * STREAM_BUFSIZE. */
+#define STREAM_BUFFERS 4
+#define STREAM_BUFSIZE (256 * 1024)
+
+#ifdef HAVE_ZLIB
+typedef struct stream_buffer_t {
+    unsigned char* data;
+    unsigned int len;
+} stream_buffer_t;
+#endif
 
 typedef struct stream_t {
     FILE* f;
 #ifdef HAVE_ZLIB
     int compressed;
-    int eos;
     z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stream_buffer_t buffers[STREAM_BUFFERS];
+    /* buffers [head, head + filled) are owned by the reader */
+    unsigned int head, filled;
+    /* read position in the head buffer */
+    unsigned int pos;
+    /* set by the inflating thread after the last buffer */
+    int eos;
+    /* set by the reader to stop the inflating thread */
+    int cancel;
 #endif
 } stream_t;
 
@@ -52,6 +52,7 @@
 #include "blocklist.h"
 #include "nfblockd.h"
 #include "parser.h"
+#include "rangeset.h"
 
 #define likely(x) __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
@@ -69,7 +70,270 @@ do_log(int priority, const char* format, ...)
     va_end(ap);
 }
 
+int
+do_log_enabled(int priority)
+{
+    return 1;
+}
+
 #define MAX_RANGES 16
+/* addresses looked up at once by the scan, several FIND_BATCH chunks */
+#define SCAN_BATCH (FIND_BATCH * 4)
+
+/* addresses covered by the sets of check_range_ops(), at base */
+#define SET_SPACE 65536
+#define SET_RANGES 512
+
+/* Fills r with random sorted ranges, neither overlapping nor adjacent,
+   and marks their addresses in bits */
+static unsigned int
+random_ranges(block_entry_t* r, uint32_t base, unsigned char* bits)
+{
+    unsigned int n = 0, ip = rand() % 64, j;
+
+    memset(bits, 0, SET_SPACE);
+    while (n < SET_RANGES) {
+        unsigned int len = rand() % 64;
+        if (ip + len >= SET_SPACE)
+            len = SET_SPACE - 1 - ip;
+        r[n].ip_min = base + ip;
+        r[n].ip_max = base + ip + len;
+        for (j = ip; j <= ip + len; j++)
+            bits[j] = 1;
+        n++;
+        ip += len + 2 + rand() % 64;
+        if (ip >= SET_SPACE)
+            break;
+    }
+    return n;
+}
+
+/* Compares the output of a set operation with the expected addresses,
+   and checks that each range lies in the range of a it came from */
+static void
+check_ranges(const char* op, const block_entry_t* out, unsigned int n,
+    const unsigned int* origin, const block_entry_t* a, uint32_t base,
+    const unsigned char* expected)
+{
+    unsigned int i, j, covered = 0;
+
+    for (i = 0; i < n; i++) {
+        if (out[i].ip_min > out[i].ip_max || out[i].ip_min < base
+            || (i > 0 && out[i].ip_min <= out[i - 1].ip_max + 1)) {
+            fprintf(stderr, "%s: bad range %u!\n", op, i);
+            return;
+        }
+        if (origin && (out[i].ip_min < a[origin[i]].ip_min
+                || out[i].ip_max > a[origin[i]].ip_max))
+            fprintf(stderr, "%s: wrong origin of range %u!\n", op, i);
+        for (j = out[i].ip_min - base; j <= out[i].ip_max - base; j++) {
+            if (!expected[j])
+                fprintf(stderr, "%s: false positive! %08x\n", op, base + j);
+        }
+        covered += out[i].ip_max - out[i].ip_min + 1;
+    }
+    for (j = 0; j < SET_SPACE; j++)
+        covered -= expected[j];
+    if (covered != 0)
+        fprintf(stderr, "%s: false negatives!\n", op);
+}
+
+/* Checks the range set operations on random sets, also at the top of
+   the address space */
+static void
+check_range_ops()
+{
+    static block_entry_t a[SET_RANGES], b[SET_RANGES], out[SET_RANGES * 2];
+    static unsigned int origin[SET_RANGES * 2];
+    static unsigned char abits[SET_SPACE], bbits[SET_SPACE], expected[SET_SPACE];
+    unsigned int round, na, nb, n, j;
+
+    for (round = 0; round < 1000; round++) {
+        uint32_t base = round & 1 ? 0 : UINT32_MAX - SET_SPACE + 1;
+
+        na = random_ranges(a, base, abits);
+        nb = random_ranges(b, base, bbits);
+
+        for (j = 0; j < SET_SPACE; j++)
+            expected[j] = abits[j] || bbits[j];
+        n = range_union(a, na, b, nb, out);
+        check_ranges("union", out, n, NULL, a, base, expected);
+
+        for (j = 0; j < SET_SPACE; j++)
+            expected[j] = abits[j] && bbits[j];
+        n = range_intersect(a, na, b, nb, out, origin);
+        check_ranges("intersect", out, n, origin, a, base, expected);
+
+        for (j = 0; j < SET_SPACE; j++)
+            expected[j] = abits[j] && !bbits[j];
+        n = range_subtract(a, na, b, nb, out, origin);
+        check_ranges("subtract", out, n, origin, a, base, expected);
+    }
+}
+
+#ifndef LOWMEM
+/* Tells if the trimmed list covers all (2), part (1) or none (0) of
+   the given range */
+static int
+list_covers(const blocklist_t* bl, uint32_t ip_min, uint32_t ip_max)
+{
+    unsigned int lo = 0, hi = bl->count;
+
+    // the first entry ending at ip_min or later
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (bl->entries[mid].ip_max < ip_min)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == bl->count || bl->entries[lo].ip_min > ip_max)
+        return 0;
+    if (bl->entries[lo].ip_min <= ip_min && bl->entries[lo].ip_max >= ip_max)
+        return 2;
+    return 1;
+}
+
+/* Loads the file into list 0 and a shifted copy of it into list 1, and
+   checks the list masks of the trimmed ranges against the lists
+   trimmed alone */
+static void
+check_lists(const char* filename)
+{
+    blocklist_t merged, single[2];
+    char name[] = "/tmp/nfblock-testXXXXXX";
+    unsigned int i;
+    int fd, k;
+    FILE* f;
+
+    blocklist_init(&single[0]);
+    load_list(&single[0], filename, NULL);
+    fd = mkstemp(name);
+    if (fd < 0 || !(f = fdopen(fd, "w"))) {
+        perror("check_lists");
+        exit(EXIT_FAILURE);
+    }
+    // every third range moved by half of its length, overlapping the rest
+    for (i = 0; i < single[0].count; i += 3) {
+        uint32_t ip_min = single[0].entries[i].ip_min;
+        uint32_t ip_max = single[0].entries[i].ip_max;
+        uint32_t shift = (ip_max - ip_min) / 2 + 1;
+        uint32_t a, b;
+        char buf1[INET_ADDRSTRLEN], buf2[INET_ADDRSTRLEN];
+
+        if (ip_max > UINT32_MAX - shift)
+            continue;
+        a = htonl(ip_min + shift);
+        b = htonl(ip_max + shift);
+        inet_ntop(AF_INET, &a, buf1, sizeof(buf1));
+        inet_ntop(AF_INET, &b, buf2, sizeof(buf2));
+        fprintf(f, "shifted %u:%s-%s\n", i, buf1, buf2);
+    }
+    fclose(f);
+
+    blocklist_init(&single[1]);
+    load_list(&single[1], name, NULL);
+    blocklist_init(&merged);
+    load_list(&merged, filename, NULL);
+    merged.list = 1;
+    load_list(&merged, name, NULL);
+    unlink(name);
+    for (k = 0; k < 2; k++) {
+        blocklist_sort(&single[k], 1);
+        blocklist_trim(&single[k], NULL);
+    }
+    blocklist_sort(&merged, 1);
+    blocklist_trim(&merged, NULL);
+
+    for (i = 0; i < merged.count; i++) {
+        block_entry_t* e = &merged.entries[i];
+        uint32_t mask = 0;
+
+        for (k = 0; k < 2; k++) {
+            int c = list_covers(&single[k], e->ip_min, e->ip_max);
+            if (c == 1)
+                fprintf(stderr, "range %u partially in list %d!\n", i, k);
+            else if (c == 2)
+                mask |= 1u << k;
+        }
+        if (merged.entries2[i].lists == 0 || merged.entries2[i].lists != mask)
+            fprintf(stderr, "range %u has lists %x instead of %x!\n", i,
+                merged.entries2[i].lists, mask);
+        if (i > 0 && merged.entries[i - 1].ip_max + 1 == e->ip_min
+            && merged.entries2[i - 1].lists == merged.entries2[i].lists)
+            fprintf(stderr, "ranges %u and %u not merged!\n", i - 1, i);
+    }
+    fprintf(stderr, "%d ranges of two lists\n", merged.count);
+    blocklist_clear(&merged, 0);
+    blocklist_clear(&single[0], 0);
+    blocklist_clear(&single[1], 0);
+}
+#endif
+
+#ifndef LOWMEM
+/* Compares the names found for ip with a linear scan of the
+   sub-entries, which lists them in the same order */
+static void
+check_names(blocklist_t* bl, const block_entry2_t* e2, uint32_t ip,
+    const char** names, unsigned int n)
+{
+    unsigned int k, cnt = 0;
+
+    if (e2->label != LABEL_NONE) {
+        if (n != 1 || strcmp(names[0], label_get(&bl->labels, e2->label)))
+            fprintf(stderr, "wrong name! %08x\n", ip);
+        return;
+    }
+    for (k = e2->merged_idx; k < e2->merged_idx + e2->merged_count && cnt < MAX_RANGES; k++) {
+        block_sub_entry_t* s = &bl->subentries[k];
+        if (s->ip_min > ip || s->ip_max < ip)
+            continue;
+        if (cnt >= n || strcmp(names[cnt], label_get(&bl->labels, s->label))) {
+            fprintf(stderr, "names differ from the linear scan! %08x\n", ip);
+            return;
+        }
+        cnt++;
+    }
+    if (cnt != n || names[n] != NULL)
+        fprintf(stderr, "%u names instead of %u! %08x\n", n, cnt, ip);
+}
+#endif
+
+/* Sorts the list with several threads and checks that the order is
+   the same as with one */
+static void
+check_threaded_sort(const char* filename)
+{
+    blocklist_t one, many;
+    unsigned int i;
+    int threads;
+
+    for (threads = 2; threads <= 4; threads++) {
+        blocklist_init(&one);
+        blocklist_init(&many);
+        load_list(&one, filename, NULL);
+        load_list(&many, filename, NULL);
+        blocklist_sort(&one, 1);
+        blocklist_sort(&many, threads);
+        for (i = 0; i < one.count; i++) {
+            if (one.entries[i].ip_min != many.entries[i].ip_min
+                || one.entries[i].ip_max != many.entries[i].ip_max
+#ifndef LOWMEM
+                || one.entries2[i].label != many.entries2[i].label
+#endif
+                ) {
+                fprintf(stderr, "sort with %d threads differs at %u!\n", threads, i);
+                break;
+            }
+            if (i > 0 && one.entries[i - 1].ip_min > one.entries[i].ip_min) {
+                fprintf(stderr, "not sorted at %u!\n", i);
+                break;
+            }
+        }
+        blocklist_clear(&one, 0);
+        blocklist_clear(&many, 0);
+    }
+}
 
 int64_t* bitfield;
 
@@ -77,7 +341,13 @@ int
 main(int argc, char* argv[])
 {
     uint64_t i, j;
+#ifndef LOWMEM
     const char* sranges[MAX_RANGES + 1];
+#endif
+    uint64_t* hits;
+    blocklist_t allowlist;
+    uint32_t ips[SCAN_BATCH];
+    block_entry2_t* batch[SCAN_BATCH];
 
     blocklist_init(&blocklist);
     blocklist_clear(&blocklist, 0);
@@ -106,19 +376,63 @@ main(int argc, char* argv[])
         for (j = blocklist.entries[i].ip_min; j <= blocklist.entries[i].ip_max; j++) {
             bitfield[j >> 6] |= (uint64_t)1 << (j & 0x3f);
         }
-        blocklist.entries2[i].hits = rand();
     }
 
-    blocklist_sort(&blocklist);
-    blocklist_trim(&blocklist);
+    check_threaded_sort("level1.gz");
+    check_range_ops();
+#ifndef LOWMEM
+    check_lists("level1.gz");
+#endif
+
+    blocklist_sort(&blocklist, 1);
+    blocklist_trim(&blocklist, NULL);
+
+    // punch random holes, like an allowlist does
+    blocklist_init(&allowlist);
+    for (i = 0; i < 1000; i++) {
+        uint32_t ip_min = ((uint32_t)rand() << 16) ^ rand();
+        uint32_t ip_max = ip_min + rand() % 65536;
+        if (ip_max < ip_min)
+            ip_max = UINT32_MAX;
+        blocklist_append(&allowlist, ip_min, ip_max, "allow");
+        for (j = ip_min; j <= ip_max; j++)
+            bitfield[j >> 6] &= ~((uint64_t)1 << (j & 0x3f));
+    }
+    blocklist_sort(&allowlist, 1);
+    blocklist_trim(&allowlist, NULL);
+    fprintf(stderr, "%d entries before subtracting the allowlist\n", blocklist.count);
+    blocklist_subtract(&blocklist, &allowlist);
+    blocklist_clear(&allowlist, 0);
     blocklist_dump(&blocklist);
 
+    hits = (uint64_t*)malloc(sizeof(uint64_t) * blocklist.count);
+    if (!hits) {
+        perror("main");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < blocklist.count; i++)
+        hits[i] = rand();
+
     fprintf(stderr, "%d entries after trim\n", blocklist.count);
     for (i = 0; i <= 0xffffffffULL; i++) {
         block_entry2_t* res;
         if ((i & 0xffffff) == 0)
             fprintf(stderr, "%08lx\n", i);
-        res = blocklist_find(&blocklist, i, sranges, MAX_RANGES);
+        res = blocklist_find(&blocklist, i);
+        // the packet path looks the addresses up in batches
+        if ((i & (SCAN_BATCH - 1)) == 0) {
+            for (j = 0; j < SCAN_BATCH; j++)
+                ips[j] = i + j;
+            blocklist_find_batch(&blocklist, ips, SCAN_BATCH, batch);
+        }
+        if (batch[i & (SCAN_BATCH - 1)] != res)
+            fprintf(stderr, "batch lookup differs! %08lx\n", i);
+#ifndef LOWMEM
+        if (res) {
+            unsigned int n = blocklist_names(&blocklist, res, i, sranges, MAX_RANGES);
+            check_names(&blocklist, res, i, sranges, n);
+        }
+#endif
         if (res == NULL) {
             if ((bitfield[i >> 6] & ((uint64_t)1 << (i & 0x3f))) != 0)
                 fprintf(stderr, "false negative! %08lx\n", i);
@@ -128,6 +442,7 @@ main(int argc, char* argv[])
         }
     }
 
-    blocklist_stats(&blocklist);
+    blocklist_stats(&blocklist, hits, 0);
+    free(hits);
     return 0;
 }
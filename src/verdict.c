@@ -0,0 +1,167 @@
+/*
+   Batched NFQUEUE verdicts
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "verdict.h"
+#include "nfblockd.h"
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#define VERDICT_MSG_SIZE                                       \
+    (NLMSG_ALIGN(sizeof(struct nlmsghdr))                      \
+        + NLMSG_ALIGN(sizeof(struct nfgenmsg))                 \
+        + NLA_ALIGN(NLA_HDRLEN + sizeof(struct nfqnl_msg_verdict_hdr)) \
+        + NLA_ALIGN(NLA_HDRLEN + sizeof(uint32_t)))
+
+void
+verdict_init(verdict_batch_t* vb, int fd, uint16_t queue,
+    uint32_t accept_verdict, uint32_t accept_mark)
+{
+    vb->fd = fd;
+    vb->queue = queue;
+    vb->accept_verdict = accept_verdict;
+    vb->accept_mark = accept_mark;
+    vb->accept_pending = 0;
+    // one more for the batch verdict
+    vb->buf = malloc((VERDICT_BATCH + 1) * VERDICT_MSG_SIZE);
+    CHECK_OOM(vb->buf);
+    vb->len = vb->count = 0;
+    vb->seq = 0;
+    vb->send = NULL;
+    vb->send_arg = NULL;
+}
+
+void
+verdict_set_sender(verdict_batch_t* vb, verdict_send_t send, void* arg)
+{
+    vb->send = send;
+    vb->send_arg = arg;
+}
+
+void
+verdict_free(verdict_batch_t* vb)
+{
+    free(vb->buf);
+    vb->buf = NULL;
+}
+
+void
+verdict_accept(verdict_batch_t* vb, uint32_t id)
+{
+    // the ids wrap around, compared like nfq_id_after() in the kernel
+    if (!vb->accept_pending || (int32_t)(id - vb->accept_id) > 0)
+        vb->accept_id = id;
+    vb->accept_pending = 1;
+}
+
+static void*
+put_attr(char* p, uint16_t type, const void* data, uint16_t len)
+{
+    struct nlattr* nla = (struct nlattr*)p;
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(p + NLA_HDRLEN, data, len);
+    return p + NLA_ALIGN(nla->nla_len);
+}
+
+static int
+send_messages(verdict_batch_t* vb)
+{
+    int ret = 0;
+
+    if (vb->count == 0)
+        return 0;
+    if (vb->send) {
+        ret = vb->send(vb->send_arg, vb->buf, vb->len);
+    } else {
+        // the socket is not connected, so it sends to the kernel
+        if (send(vb->fd, vb->buf, vb->len, 0) < 0)
+            ret = -1;
+        __atomic_store_n(&vb->syscalls, vb->syscalls + 1, __ATOMIC_RELAXED);
+    }
+    vb->len = vb->count = 0;
+    return ret;
+}
+
+/* Appends one verdict message, type is NFQNL_MSG_VERDICT or
+   NFQNL_MSG_VERDICT_BATCH */
+static void
+put_verdict(verdict_batch_t* vb, uint16_t type, uint32_t id, uint32_t verdict,
+    int has_mark, uint32_t mark)
+{
+    char* p = vb->buf + vb->len;
+    struct nlmsghdr* nlh = (struct nlmsghdr*)p;
+    struct nfgenmsg* nfg;
+    struct nfqnl_msg_verdict_hdr vh;
+
+    nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = ++vb->seq;
+    nlh->nlmsg_pid = 0;
+    nfg = (struct nfgenmsg*)(p + NLMSG_ALIGN(sizeof(struct nlmsghdr)));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(vb->queue);
+
+    p = (char*)nfg + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+    vh.verdict = htonl(verdict);
+    vh.id = htonl(id);
+    p = put_attr(p, NFQA_VERDICT_HDR, &vh, sizeof(vh));
+    if (has_mark) {
+        // same byte order as nfq_set_verdict2() uses
+        mark = htonl(mark);
+        p = put_attr(p, NFQA_MARK, &mark, sizeof(mark));
+    }
+
+    nlh->nlmsg_len = p - (char*)nlh;
+    vb->len += NLMSG_ALIGN(nlh->nlmsg_len);
+    vb->count++;
+}
+
+int
+verdict_set(verdict_batch_t* vb, uint32_t id, uint32_t verdict,
+    int has_mark, uint32_t mark)
+{
+    int ret = 0;
+
+    if (vb->count == VERDICT_BATCH)
+        ret = send_messages(vb);
+    put_verdict(vb, NFQNL_MSG_VERDICT, id, verdict, has_mark, mark);
+    return ret;
+}
+
+/* Sends the collected verdicts. The batch verdict goes last, as it
+   applies to all the packets up to its id that are still waiting. */
+int
+verdict_flush(verdict_batch_t* vb)
+{
+    if (vb->accept_pending) {
+        put_verdict(vb, NFQNL_MSG_VERDICT_BATCH, vb->accept_id,
+            vb->accept_verdict, vb->accept_mark != 0, vb->accept_mark);
+        vb->accept_pending = 0;
+    }
+    return send_messages(vb);
+}
@@ -0,0 +1,74 @@
+/*
+   Batched NFQUEUE verdicts
+
+   (c) 2008 Jindrich Makovicka (makovick@gmail.com)
+
+   This file is part of NFblock.
+
+   NFblock is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   NFblockD is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GNU Emacs; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef VERDICT_H
+#define VERDICT_H
+
+#include <inttypes.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+/* verdicts collected before they are sent */
+#define VERDICT_BATCH 256
+
+/* Sends len bytes of netlink messages, returns < 0 on error. The
+   buffer stays untouched until the next verdict_set() or
+   verdict_flush(). */
+typedef int (*verdict_send_t)(void* arg, const char* buf, unsigned int len);
+
+/* Collects the verdicts of the packets handled in one pass. The
+   accepted packets get one batch verdict for the highest packet id,
+   placed after the individual verdicts of the other packets in one
+   multi-part netlink message, so a pass costs a single send. */
+typedef struct verdict_batch_t {
+    int fd;
+    uint16_t queue;
+
+    /* verdict and mark (if not 0) given to the accepted packets */
+    uint32_t accept_verdict, accept_mark;
+    uint32_t accept_id;
+    int accept_pending;
+
+    char* buf;
+    unsigned int len, count;
+    uint32_t seq;
+
+    /* replaces send() on fd if set, see verdict_set_sender() */
+    verdict_send_t send;
+    void* send_arg;
+
+    /* number of send() calls made, not reset by verdict_init() so
+       that it survives a rebind */
+    uint64_t syscalls;
+} verdict_batch_t;
+
+void verdict_init(verdict_batch_t* vb, int fd, uint16_t queue,
+    uint32_t accept_verdict, uint32_t accept_mark);
+void verdict_set_sender(verdict_batch_t* vb, verdict_send_t send, void* arg);
+void verdict_free(verdict_batch_t* vb);
+void verdict_accept(verdict_batch_t* vb, uint32_t id);
+/* mark is only placed on the packet if has_mark is set */
+int verdict_set(verdict_batch_t* vb, uint32_t id, uint32_t verdict,
+    int has_mark, uint32_t mark);
+int verdict_flush(verdict_batch_t* vb);
+
+#endif